@@ -0,0 +1,74 @@
+// Host stand-ins for the board and main loop services used by the DFU code
+
+#include "board.h"
+#include "main.h"
+#include "host.h"
+#include "dfu_write.h"
+#include "lcd.h"
+#include <stdio.h>
+#include <time.h>
+
+static uint32_t schedule_reset_delay = 0;
+
+uint32_t main_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void main_schedule_reset(uint32_t delay)
+{
+    schedule_reset_delay = delay;
+}
+
+uint32_t host_take_reset()
+{
+    uint32_t delay = schedule_reset_delay;
+    schedule_reset_delay = 0;
+    return delay;
+}
+
+void host_print_write_stats(const char *title)
+{
+    dfu_write_stats_t s;
+    dfu_write_get_stats(&s);
+    printf("%s: blocks %u/%u, duplicates %u, out of order %u, resumed %u, bytes programmed %u, skipped %u\n", //
+           title, s.blocks_received, s.num_blocks, s.duplicates, s.out_of_order, s.blocks_resumed,          //
+           s.bytes_programmed, s.bytes_skipped);
+
+    static const char *const results[] = {"none", "pass", "fail"};
+    dfu_verify_t v;
+    dfu_write_get_verify(&v);
+    printf("%s: verify %s, expected crc %08x, actual %08x\n", title, results[v.result], v.expected_crc, v.actual_crc);
+}
+
+// LCD ----------
+
+void lcd_display_logo()
+{
+}
+
+#if defined(LCD_VERIFY)
+void lcd_display_verify(bool pass)
+{
+}
+#endif
+
+// Backlight ----------
+
+void board_backlight_on(uint32_t delay)
+{
+}
+
+void board_backlight_off()
+{
+}
+
+void board_backlight_flash(uint32_t delay)
+{
+}
+
+void board_backlight_update()
+{
+}
@@ -0,0 +1,44 @@
+#ifndef _FLASH_SIM_H
+#define _FLASH_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Typical PY32F071 datasheet figures, in us
+#define FLASH_SIM_DEFAULT_PAGE_PROGRAM_US 1500
+#define FLASH_SIM_DEFAULT_PAGE_ERASE_US 3500
+#define FLASH_SIM_DEFAULT_SECTOR_ERASE_US 3500
+
+typedef struct
+{
+    uint32_t page_program_us;
+    uint32_t page_erase_us;
+    uint32_t sector_erase_us;
+    bool realtime; // Actually sleep for the modeled latencies
+} flash_sim_timing_t;
+
+typedef struct
+{
+    uint32_t page_writes;   // Calls into the flash driver
+    uint32_t page_skips;    // Pages skipped as identical
+    uint32_t page_programs; //
+    uint32_t page_erases;   //
+    uint32_t sector_erases; //
+    uint64_t busy_us;       // Modeled flash time the DFU code waited for
+    uint64_t hidden_us;     // Async erase time overlapped with bus time
+} flash_sim_stats_t;
+
+// Maps the simulated flash at FLASH_BASE, so the DFU code can keep
+// dereferencing flash addresses as it does on the MCU.
+int flash_sim_init(const flash_sim_timing_t *timing);
+int flash_sim_load(const char *path, uint32_t addr);
+int flash_sim_save(const char *path, uint32_t addr, uint32_t size);
+
+// Lets modeled time pass outside the flash driver, e.g. packets on the bus
+void flash_sim_elapse(uint32_t us);
+
+void flash_sim_get_stats(flash_sim_stats_t *stats);
+void flash_sim_reset_stats();
+void flash_sim_print_stats(const char *title);
+
+#endif // _FLASH_SIM_H
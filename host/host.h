@@ -0,0 +1,12 @@
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdint.h>
+
+// Returns the delay passed to main_schedule_reset(), or 0, and clears it
+uint32_t host_take_reset();
+
+// Prints dfu_write_get_stats() and dfu_write_get_verify()
+void host_print_write_stats(const char *title);
+
+#endif // _HOST_H
@@ -0,0 +1,196 @@
+// RAM-backed stand-in for src/internal_flash.c
+
+#include "internal_flash.h"
+#include "flash_sim.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "py32f0xx.h"
+
+#define SIM_FLASH_SIZE (FLASH_END + 1 - FLASH_BASE)
+
+static uint8_t *flash_mem = NULL;
+static flash_sim_timing_t sim_timing;
+static flash_sim_stats_t sim_stats;
+
+static void flash_busy(uint32_t us)
+{
+    sim_stats.busy_us += us;
+    if (sim_timing.realtime)
+    {
+        usleep(us);
+    }
+}
+
+static inline uint8_t *flash_ptr(uint32_t addr)
+{
+    return flash_mem + (addr - FLASH_BASE);
+}
+
+static bool page_need_erase(uint32_t addr)
+{
+    const uint8_t *p = flash_ptr(addr);
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i++)
+    {
+        if (0xff != p[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void page_erase(uint32_t addr)
+{
+    memset(flash_ptr(addr - addr % FLASH_PAGE_SIZE), 0xff, FLASH_PAGE_SIZE);
+    sim_stats.page_erases++;
+    flash_busy(sim_timing.page_erase_us);
+}
+
+// Async operations take effect at once; their modeled time runs down as the
+// bus model reports elapsed time (flash_sim_elapse) and the rest is waited
+// out by the next flash operation.
+static uint32_t pending_us = 0;
+
+void internal_flash_wait()
+{
+    flash_busy(pending_us);
+    pending_us = 0;
+}
+
+bool internal_flash_is_busy()
+{
+    return pending_us > 0;
+}
+
+void flash_sim_elapse(uint32_t us)
+{
+    const uint32_t n = us < pending_us ? us : pending_us;
+    pending_us -= n;
+    sim_stats.hidden_us += n;
+}
+
+void internal_flash_erase_sector_async(uint32_t addr)
+{
+    internal_flash_wait();
+    memset(flash_ptr(addr - addr % FLASH_SECTOR_SIZE), 0xff, FLASH_SECTOR_SIZE);
+    sim_stats.sector_erases++;
+    pending_us = sim_timing.sector_erase_us;
+}
+
+void internal_flash_erase_page(uint32_t addr)
+{
+    internal_flash_wait();
+    if (page_need_erase(addr))
+    {
+        page_erase(addr);
+    }
+}
+
+bool internal_flash_program_page(uint32_t addr, const uint8_t *buf)
+{
+    internal_flash_wait();
+    sim_stats.page_writes++;
+
+    if (0 == memcmp(flash_ptr(addr), buf, FLASH_PAGE_SIZE))
+    {
+        sim_stats.page_skips++;
+        return false;
+    }
+
+    if (page_need_erase(addr))
+    {
+        page_erase(addr);
+    }
+
+    // NOR semantics: programming can only clear bits
+    uint8_t *p = flash_ptr(addr);
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i++)
+    {
+        p[i] &= buf[i];
+    }
+
+    sim_stats.page_programs++;
+    pending_us = sim_timing.page_program_us;
+    return true;
+}
+
+// ----------
+
+int flash_sim_init(const flash_sim_timing_t *timing)
+{
+    void *p = mmap((void *)FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, //
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (MAP_FAILED == p || (void *)FLASH_BASE != p)
+    {
+        perror("flash_sim: mmap");
+        return -1;
+    }
+
+    flash_mem = p;
+    memset(flash_mem, 0xff, SIM_FLASH_SIZE);
+
+    sim_timing = *timing;
+    flash_sim_reset_stats();
+    return 0;
+}
+
+int flash_sim_load(const char *path, uint32_t addr)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    const size_t max = FLASH_END + 1 - addr;
+    size_t n = fread(flash_ptr(addr), 1, max, f);
+    fclose(f);
+
+    printf("flash_sim: loaded %zu bytes at %08x\n", n, addr);
+    return 0;
+}
+
+int flash_sim_save(const char *path, uint32_t addr, uint32_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t n = fwrite(flash_ptr(addr), 1, size, f);
+    fclose(f);
+
+    return n == size ? 0 : -1;
+}
+
+void flash_sim_get_stats(flash_sim_stats_t *stats)
+{
+    *stats = sim_stats;
+}
+
+void flash_sim_reset_stats()
+{
+    memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+void flash_sim_print_stats(const char *title)
+{
+    // Count the operation still in flight
+    internal_flash_wait();
+
+    const flash_sim_stats_t *s = &sim_stats;
+
+    printf("%s: page writes %u, skipped %u, programs %u, page erases %u, sector erases %u, flash time %llu.%03llu ms", //
+           title, s->page_writes, s->page_skips, s->page_programs, s->page_erases, s->sector_erases,                //
+           (unsigned long long)(s->busy_us / 1000), (unsigned long long)(s->busy_us % 1000));
+    if (s->hidden_us)
+    {
+        printf(" (+%llu.%03llu ms behind USB)", (unsigned long long)(s->hidden_us / 1000), (unsigned long long)(s->hidden_us % 1000));
+    }
+    printf("\n");
+}
@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+"""Produce sector traces for host/moto_replay.
+
+Trace format (CSV, '#' starts a comment):
+
+    op,lba,count[,file_sector]
+
+op is R or W. For writes, file_sector is the sector offset within the copied
+file the data comes from, or -1 for metadata (replayed as the file's FAT chain
+and directory entry in the FAT and root directory, zeros elsewhere). If the
+column is absent, moto_replay assumes the file occupies contiguous clusters
+starting at the first free cluster of the MOTO volume.
+
+Subcommands:
+
+    mktrace.py [-o OUT] model {linux,windows,macos} FILE   model a host copying FILE
+    mktrace.py [-o OUT] usbmon CAPTURE.pcap                extract READ/WRITE(10) from
+                                                           a usbmon capture
+
+The models follow the write ordering each host is known to use; they are not
+captures. Replace them with usbmon captures where real hardware is available.
+"""
+import sys
+import os
+import struct
+import argparse
+
+# MOTO volume geometry, see src/dfu.h
+FAT_SECTOR = 1
+FAT_SECTOR_NUM = 125
+ROOT_SECTOR = FAT_SECTOR + FAT_SECTOR_NUM
+ROOT_SECTOR_NUM = 32
+DATA_SECTOR = ROOT_SECTOR + ROOT_SECTOR_NUM
+SECTOR_SIZE = 512
+FAT_ENTRIES_PER_SECTOR = SECTOR_SIZE // 2
+
+FW_PAGE_NUM = (128 * 1024 - 10 * 1024) // 256
+# MOTO.TXT, INFO_UF2.TXT, INDEX.HTM, then CURRENT.UF2
+FIRST_FREE_CLUSTER = 2 + 3 + FW_PAGE_NUM
+
+
+def cluster_lba(cluster):
+    return DATA_SECTOR + cluster - 2
+
+
+def fat_sectors(first_cluster, num):
+    first = first_cluster // FAT_ENTRIES_PER_SECTOR
+    last = (first_cluster + num - 1) // FAT_ENTRIES_PER_SECTOR
+    return range(FAT_SECTOR + first, FAT_SECTOR + last + 1)
+
+
+class Trace:
+    def __init__(self):
+        self.lines = []
+
+    def comment(self, text):
+        self.lines.append("# " + text)
+
+    def read(self, lba, count):
+        self.lines.append("R,%d,%d" % (lba, count))
+
+    def write_meta(self, lba, count=1):
+        self.lines.append("W,%d,%d,-1" % (lba, count))
+
+    def write_fat(self, first_cluster, num):
+        for s in fat_sectors(first_cluster, num):
+            self.write_meta(s)
+
+    def write_file(self, first_cluster, file_sector, count, chunk):
+        while count > 0:
+            n = min(chunk, count)
+            self.lines.append("W,%d,%d,%d" % (cluster_lba(first_cluster + file_sector), n, file_sector))
+            file_sector += n
+            count -= n
+
+    def mount_reads(self):
+        self.read(0, 1)
+        self.read(FAT_SECTOR, 8)
+        self.read(ROOT_SECTOR, ROOT_SECTOR_NUM)
+
+    def text(self):
+        return "\n".join(self.lines) + "\n"
+
+
+def model_linux(num):
+    # cp + sync on a default (async) vfat mount: writeback flushes data in
+    # ascending max_sectors (120 KB) requests, then the FAT, then the directory.
+    t = Trace()
+    t.comment("linux vfat: cp + sync")
+    t.mount_reads()
+    first = FIRST_FREE_CLUSTER
+    t.write_file(first, 0, num, 240)
+    t.write_fat(first, num)
+    t.write_meta(ROOT_SECTOR)
+    return t
+
+
+def model_windows(num):
+    # Explorer on a quick-removal volume: write-through. The directory entry is
+    # created first, each 64 KB write extends the cluster chain in the FAT, and
+    # the final size lands in the directory entry after the data.
+    t = Trace()
+    t.comment("windows explorer: quick removal")
+    t.mount_reads()
+    first = FIRST_FREE_CLUSTER
+    t.write_meta(ROOT_SECTOR)
+    done = 0
+    while done < num:
+        n = min(128, num - done)
+        t.write_fat(first + done, n)
+        t.write_file(first, done, n, 128)
+        done += n
+    t.write_meta(ROOT_SECTOR)
+    t.write_fat(first, num)
+    t.write_meta(ROOT_SECTOR)
+    return t
+
+
+def model_macos(num):
+    # Finder: sets the FAT dirty bit, creates .fseventsd and the AppleDouble
+    # "._" companion before the data, writes data in 128 KB requests, then
+    # updates FAT and directory and clears the dirty bit on eject.
+    t = Trace()
+    t.comment("macos finder")
+    t.mount_reads()
+    t.write_meta(FAT_SECTOR)
+    cluster = FIRST_FREE_CLUSTER
+    # .fseventsd directory + fseventsd-uuid
+    t.write_meta(ROOT_SECTOR)
+    t.write_meta(cluster_lba(cluster), 1)
+    t.write_meta(cluster_lba(cluster + 1), 1)
+    t.write_fat(cluster, 2)
+    cluster += 2
+    # ._FILE (4 KB)
+    t.write_meta(ROOT_SECTOR)
+    t.write_meta(cluster_lba(cluster), 8)
+    t.write_fat(cluster, 8)
+    cluster += 8
+    # FILE
+    t.write_meta(ROOT_SECTOR)
+    t.write_file(cluster, 0, num, 256)
+    t.write_fat(cluster, num)
+    t.write_meta(ROOT_SECTOR)
+    # .fseventsd log on eject, dirty bit cleared
+    t.write_meta(cluster_lba(cluster + num), 1)
+    t.write_fat(cluster + num, 1)
+    t.write_meta(FAT_SECTOR)
+    return t
+
+
+MODELS = {
+    "linux": model_linux,
+    "windows": model_windows,
+    "macos": model_macos,
+}
+
+
+def parse_usbmon(buf):
+    # pcap with LINKTYPE_USB_LINUX (189) or LINKTYPE_USB_LINUX_MMAPPED (220)
+    magic = struct.unpack("<I", buf[0:4])[0]
+    if magic == 0xa1b2c3d4:
+        endian = "<"
+    elif magic == 0xd4c3b2a1:
+        endian = ">"
+    else:
+        raise ValueError("not a pcap file")
+    linktype = struct.unpack(endian + "I", buf[20:24])[0]
+    if linktype == 189:
+        hdr_len = 48
+    elif linktype == 220:
+        hdr_len = 64
+    else:
+        raise ValueError("unsupported link type %d" % linktype)
+
+    t = Trace()
+    t.comment("usbmon capture")
+    ptr = 24
+    while ptr + 16 <= len(buf):
+        incl_len = struct.unpack(endian + "I", buf[ptr + 8:ptr + 12])[0]
+        pkt = buf[ptr + 16:ptr + 16 + incl_len]
+        ptr += 16 + incl_len
+        if len(pkt) < hdr_len + 31:
+            continue
+        # event 'S', transfer type bulk (3), OUT endpoint
+        if pkt[8] != ord("S") or pkt[9] != 3 or pkt[10] & 0x80:
+            continue
+        cbw = pkt[hdr_len:hdr_len + 31]
+        if cbw[0:4] != b"USBC":
+            continue
+        cb = cbw[15:]
+        if cb[0] in (0x28, 0x2a):
+            lba = struct.unpack(">I", cb[2:6])[0]
+            count = struct.unpack(">H", cb[7:9])[0]
+            t.lines.append("%s,%d,%d" % ("R" if cb[0] == 0x28 else "W", lba, count))
+    return t
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Produce sector traces for moto_replay.")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("model", help="model a host copying a file")
+    p.add_argument("host", choices=MODELS.keys())
+    p.add_argument("file")
+    p = sub.add_parser("usbmon", help="extract READ/WRITE(10) from a usbmon pcap")
+    p.add_argument("capture")
+    parser.add_argument("-o", "--output", metavar="FILE", help="write to FILE instead of stdout")
+    args = parser.parse_args()
+
+    if args.cmd == "model":
+        num = (os.path.getsize(args.file) + SECTOR_SIZE - 1) // SECTOR_SIZE
+        t = MODELS[args.host](num)
+    else:
+        with open(args.capture, "rb") as f:
+            t = parse_usbmon(f.read())
+
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(t.text())
+    else:
+        sys.stdout.write(t.text())
+
+
+if __name__ == "__main__":
+    main()
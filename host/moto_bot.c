@@ -0,0 +1,566 @@
+// Replays a sector trace through the USB mass storage stack.
+//
+// Usage: moto_bot [-f fw.bin] [-P us] [-E us] [-S us] trace.csv file.uf2
+//
+//   -f FILE   preload firmware image at FW_ADDR
+//   -P/-E/-S  page program / page erase / sector erase latency, in us
+//
+// The CherryUSB core, MSC class and usbd_msc_impl.c run on the simulated
+// port (usb_dc_sim.c). Each trace command becomes a READ(10)/WRITE(10)
+// CBW, 64-byte data packets and a CSW, after enumeration as a host would do.
+// The main loop work (the MSC thread when built with ENABLE_MSC_THREAD, and
+// usb_fs_process()) runs between packets. No packet moves while the flash is
+// busy, as on the MCU (see USB_IRQHandler() in src/internal_flash.c).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "usbd_core.h"
+#include "usbd_msc.h"
+#include "usb_scsi.h"
+#include "usb_fs.h"
+#include "dfu.h"
+#include "flash_sim.h"
+#include "internal_flash.h"
+#include "usb_sim.h"
+#ifdef CONFIG_USBDEV_MSC_THREAD
+#include "usb_osal.h"
+#endif
+#include "host.h"
+#include "trace.h"
+
+#define MSC_IN_EP 0x81
+#define MSC_OUT_EP 0x02
+#define BULK_MPS 64
+
+// Give up on an endpoint that keeps NAKing
+#define MAX_NAKS 1000
+
+enum
+{
+    CLASS_READ,
+    CLASS_WRITE,
+    CLASS_OTHER,
+    CLASS_NUM,
+};
+
+static const char *const class_names[CLASS_NUM] = {"READ(10)", "WRITE(10)", "other"};
+
+typedef struct
+{
+    uint32_t commands;
+    uint32_t failed;
+    uint32_t sectors;
+    uint32_t packets;
+    uint32_t naks;
+    uint64_t latency_us; // Modeled CBW to CSW time
+    uint64_t max_latency_us;
+    uint64_t bot_ns; // Device time outside the storage callbacks
+} class_stats_t;
+
+static class_stats_t stats[CLASS_NUM] = {0};
+static uint32_t reset_line = 0;
+static uint32_t commands_after_reset = 0;
+
+// Storage time, to separate BOT/core overhead from the DFU code ----------
+
+static uint64_t storage_ns = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int __real_usb_fs_sector_read(uint32_t sector, uint8_t *buf, uint32_t size);
+int __real_usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size);
+
+int __wrap_usb_fs_sector_read(uint32_t sector, uint8_t *buf, uint32_t size)
+{
+    uint64_t t0 = now_ns();
+    int res = __real_usb_fs_sector_read(sector, buf, size);
+    storage_ns += now_ns() - t0;
+    return res;
+}
+
+int __wrap_usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
+{
+    uint64_t t0 = now_ns();
+    int res = __real_usb_fs_sector_write(sector, buf, size);
+    storage_ns += now_ns() - t0;
+    return res;
+}
+
+// Main loop work, timed as device time when it runs the MSC thread
+static uint64_t thread_ns = 0;
+
+static void main_loop()
+{
+#ifdef CONFIG_USBDEV_MSC_THREAD
+    uint64_t t0 = now_ns();
+    usb_osal_run();
+    thread_ns += now_ns() - t0;
+#endif
+    usb_fs_process();
+}
+
+// Host side transactions ----------
+
+// The USB interrupt waits for the flash, as the USB stack runs from it
+static void usb_wait_flash()
+{
+    internal_flash_wait();
+}
+
+static int bulk_out(const uint8_t *buf, uint32_t len)
+{
+    for (int i = 0; i < MAX_NAKS; i++)
+    {
+        usb_wait_flash();
+        int res = usb_sim_out(MSC_OUT_EP, buf, len);
+        main_loop();
+        if (USB_SIM_NAK != res)
+        {
+            flash_sim_elapse(USB_SIM_PACKET_US);
+            return res;
+        }
+    }
+    return USB_SIM_NAK;
+}
+
+static int bulk_in(uint8_t *buf)
+{
+    for (int i = 0; i < MAX_NAKS; i++)
+    {
+        usb_wait_flash();
+        int res = usb_sim_in(MSC_IN_EP, buf);
+        main_loop();
+        if (USB_SIM_NAK != res)
+        {
+            flash_sim_elapse(USB_SIM_PACKET_US);
+            return res;
+        }
+    }
+    return USB_SIM_NAK;
+}
+
+static int clear_halt(uint8_t ep)
+{
+    struct usb_setup_packet setup = {
+        .bmRequestType = USB_REQUEST_STANDARD | USB_REQUEST_RECIPIENT_ENDPOINT,
+        .bRequest = USB_REQUEST_CLEAR_FEATURE,
+        .wValue = USB_FEATURE_ENDPOINT_HALT,
+        .wIndex = ep,
+        .wLength = 0,
+    };
+    return usb_sim_control(&setup, NULL);
+}
+
+static int control_in(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+    struct usb_setup_packet setup = {
+        .bmRequestType = USB_REQUEST_DIR_IN | type,
+        .bRequest = request,
+        .wValue = value,
+        .wIndex = index,
+        .wLength = len,
+    };
+    return usb_sim_control(&setup, data);
+}
+
+static int control_out(uint8_t type, uint8_t request, uint16_t value, uint16_t index)
+{
+    struct usb_setup_packet setup = {
+        .bmRequestType = type,
+        .bRequest = request,
+        .wValue = value,
+        .wIndex = index,
+        .wLength = 0,
+    };
+    return usb_sim_control(&setup, NULL);
+}
+
+static int enumerate()
+{
+    uint8_t buf[256];
+
+    usb_sim_bus_reset();
+
+    if (control_in(USB_REQUEST_STANDARD, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_TYPE_DEVICE << 8, 0, buf, 18) != 18 //
+        || control_out(USB_REQUEST_STANDARD, USB_REQUEST_SET_ADDRESS, 1, 0) < 0                                         //
+        || control_in(USB_REQUEST_STANDARD, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_TYPE_CONFIGURATION << 8, 0, buf, 9) != 9)
+    {
+        return -1;
+    }
+    uint16_t total = buf[2] | (buf[3] << 8);
+    if (control_in(USB_REQUEST_STANDARD, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_TYPE_CONFIGURATION << 8, 0, buf, total) != total //
+        || control_out(USB_REQUEST_STANDARD, USB_REQUEST_SET_CONFIGURATION, 1, 0) < 0                                               //
+        || control_in(USB_REQUEST_CLASS | USB_REQUEST_RECIPIENT_INTERFACE, MSC_REQUEST_GET_MAX_LUN, 0, 0, buf, 1) != 1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Bulk-only transport ----------
+
+typedef struct
+{
+    uint8_t cb[16];
+    uint8_t cb_len;
+    bool dir_in;
+    uint32_t data_len;
+    uint32_t sectors;
+    const trace_cmd_t *trace_cmd; // Source of write data
+    uint8_t *in_buf;              // Where read data goes, if kept
+} bot_cmd_t;
+
+static int bot_data_out(const bot_cmd_t *c)
+{
+    static uint32_t sector_buf[SECTOR_SIZE / 4];
+
+    for (uint32_t i = 0; i < c->sectors; i++)
+    {
+        if (c->trace_cmd)
+        {
+            trace_get_sector(c->trace_cmd, i, (uint8_t *)sector_buf);
+        }
+        else
+        {
+            memset(sector_buf, 0, SECTOR_SIZE);
+        }
+
+        for (uint32_t j = 0; j < SECTOR_SIZE; j += BULK_MPS)
+        {
+            int res = bulk_out((uint8_t *)sector_buf + j, BULK_MPS);
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+static int bot_data_in(const bot_cmd_t *c)
+{
+    uint8_t packet[BULK_MPS];
+    uint32_t len = 0;
+    while (len < c->data_len)
+    {
+        int res = bulk_in(packet);
+        if (res < 0)
+        {
+            return res;
+        }
+        if (c->in_buf)
+        {
+            memcpy(c->in_buf + len, packet, res < c->data_len - len ? res : c->data_len - len);
+        }
+        len += res;
+        if (res < BULK_MPS)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+static int bot_read_csw(struct CSW *csw)
+{
+    uint8_t packet[BULK_MPS];
+    int res = bulk_in(packet);
+    if (USB_SIM_STALL == res)
+    {
+        // Data phase was cut short, CSW follows the clear
+        clear_halt(MSC_IN_EP);
+        res = bulk_in(packet);
+    }
+    if (USB_SIZEOF_MSC_CSW != res)
+    {
+        return -1;
+    }
+    memcpy(csw, packet, USB_SIZEOF_MSC_CSW);
+    return MSC_CSW_Signature == csw->dSignature ? 0 : -1;
+}
+
+// Returns the CSW status, or -1 on a transport error
+static int bot_command(const bot_cmd_t *c, class_stats_t *cs)
+{
+    static uint32_t tag = 0;
+
+    struct CBW cbw = {
+        .dSignature = MSC_CBW_Signature,
+        .dTag = ++tag,
+        .dDataLength = c->data_len,
+        .bmFlags = c->dir_in ? 0x80 : 0x00,
+        .bLUN = 0,
+        .bCBLength = c->cb_len,
+    };
+    memcpy(cbw.CB, c->cb, c->cb_len);
+
+    usb_sim_stats_t us0, us1;
+    flash_sim_stats_t fs0, fs1;
+    usb_sim_get_stats(&us0);
+    flash_sim_get_stats(&fs0);
+    uint64_t storage0 = storage_ns;
+    uint64_t thread0 = thread_ns;
+
+    int res = bulk_out((uint8_t *)&cbw, USB_SIZEOF_MSC_CBW);
+    if (USB_SIZEOF_MSC_CBW == res && c->data_len)
+    {
+        res = c->dir_in ? bot_data_in(c) : bot_data_out(c);
+        if (USB_SIM_STALL == res && !c->dir_in)
+        {
+            clear_halt(MSC_OUT_EP);
+        }
+    }
+
+    // A device that fails a command early NAKs the rest of the data and
+    // sends its CSW, which the host then picks up
+    struct CSW csw;
+    int status = bot_read_csw(&csw) ? -1 : csw.bStatus;
+
+    usb_sim_get_stats(&us1);
+    flash_sim_get_stats(&fs1);
+
+    const uint32_t packets = (us1.in_packets - us0.in_packets) + (us1.out_packets - us0.out_packets);
+    const uint64_t device_ns = us1.device_ns - us0.device_ns + (thread_ns - thread0);
+    const uint64_t latency_us = device_ns / 1000 + (fs1.busy_us - fs0.busy_us) + packets * USB_SIM_PACKET_US;
+
+    cs->commands++;
+    cs->failed += 0 != status;
+    cs->sectors += c->sectors;
+    cs->packets += packets;
+    cs->naks += us1.naks - us0.naks;
+    cs->latency_us += latency_us;
+    if (latency_us > cs->max_latency_us)
+    {
+        cs->max_latency_us = latency_us;
+    }
+    cs->bot_ns += device_ns - (storage_ns - storage0);
+
+    return status;
+}
+
+static int bot_simple(uint8_t opcode, bool dir_in, uint32_t data_len)
+{
+    bot_cmd_t c = {
+        .cb = {opcode},
+        .cb_len = SCSI_CMD_READCAPACITY10 == opcode ? 10 : 6,
+        .dir_in = dir_in,
+        .data_len = data_len,
+    };
+    if (SCSI_CMD_INQUIRY == opcode)
+    {
+        c.cb[4] = data_len;
+    }
+    return bot_command(&c, &stats[CLASS_OTHER]);
+}
+
+// Sense key, ASC and ASQ of a failed poll, see bot_poll_unit()
+static uint32_t unit_sense = 0;
+
+// Polls the unit as hosts do, and keeps the sense of a failure, e.g. the
+// unit attention of ENABLE_STAY_IN_DFU once the image is written
+static int bot_poll_unit()
+{
+    int status = bot_simple(SCSI_CMD_TESTUNITREADY, false, 0);
+    if (1 != status)
+    {
+        return status;
+    }
+
+    uint8_t sense[18] = {0};
+    bot_cmd_t c = {
+        .cb = {SCSI_CMD_REQUESTSENSE, 0, 0, 0, sizeof(sense)},
+        .cb_len = 6,
+        .dir_in = true,
+        .data_len = sizeof(sense),
+        .in_buf = sense,
+    };
+    if (bot_command(&c, &stats[CLASS_OTHER]))
+    {
+        return -1;
+    }
+    unit_sense = (sense[2] & 0xf) << 16 | sense[12] << 8 | sense[13];
+    return 0;
+}
+
+static int bot_sync_cache()
+{
+    bot_cmd_t c = {
+        .cb = {SCSI_CMD_SYNCHCACHE10},
+        .cb_len = 10,
+    };
+    return bot_command(&c, &stats[CLASS_OTHER]);
+}
+
+static int bot_rw(const trace_cmd_t *cmd)
+{
+    bot_cmd_t c = {
+        .cb = {'R' == cmd->op ? SCSI_CMD_READ10 : SCSI_CMD_WRITE10, 0, //
+               cmd->lba >> 24, cmd->lba >> 16, cmd->lba >> 8, cmd->lba, //
+               0, cmd->count >> 8, cmd->count},
+        .cb_len = 10,
+        .dir_in = 'R' == cmd->op,
+        .data_len = cmd->count * SECTOR_SIZE,
+        .sectors = cmd->count,
+        .trace_cmd = 'W' == cmd->op ? cmd : NULL,
+    };
+    return bot_command(&c, &stats['R' == cmd->op ? CLASS_READ : CLASS_WRITE]);
+}
+
+static int replay(const char *path)
+{
+    trace_t t;
+    if (trace_open(&t, path))
+    {
+        return -1;
+    }
+
+    trace_cmd_t cmd;
+    int res;
+    while (1 == (res = trace_next(&t, &cmd)))
+    {
+        if (reset_line)
+        {
+            commands_after_reset++;
+        }
+
+        if (bot_rw(&cmd) < 0)
+        {
+            fprintf(stderr, "%s:%u: transport error\n", path, t.line_no);
+            res = -1;
+            break;
+        }
+
+        if (host_take_reset() && !reset_line)
+        {
+            reset_line = t.line_no;
+        }
+    }
+
+    trace_close(&t);
+    return res;
+}
+
+static void print_stats()
+{
+    for (int i = 0; i < CLASS_NUM; i++)
+    {
+        const class_stats_t *cs = &stats[i];
+        if (!cs->commands)
+        {
+            continue;
+        }
+        printf("  %-9s %5u cmds (%u failed), %6u sectors", class_names[i], cs->commands, cs->failed, cs->sectors);
+        if (cs->sectors)
+        {
+            printf(", %.2f packets/sector", (double)cs->packets / cs->sectors);
+        }
+        printf(", %u NAKs\n", cs->naks);
+        printf("            CBW->CSW avg %llu us, max %llu us; BOT %llu ns/cmd\n", //
+               (unsigned long long)(cs->latency_us / cs->commands),              //
+               (unsigned long long)cs->max_latency_us,                           //
+               (unsigned long long)(cs->bot_ns / cs->commands));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    flash_sim_timing_t timing = {
+        .page_program_us = FLASH_SIM_DEFAULT_PAGE_PROGRAM_US,
+        .page_erase_us = FLASH_SIM_DEFAULT_PAGE_ERASE_US,
+        .sector_erase_us = FLASH_SIM_DEFAULT_SECTOR_ERASE_US,
+        .realtime = false,
+    };
+    const char *fw_in = NULL;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "f:P:E:S:")))
+    {
+        switch (opt)
+        {
+        case 'f':
+            fw_in = optarg;
+            break;
+        case 'P':
+            timing.page_program_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'E':
+            timing.page_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            timing.sector_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "usage: %s [-f fw.bin] [-P us] [-E us] [-S us] trace.csv file.uf2\n", argv[0]);
+        return 1;
+    }
+
+    if (flash_sim_init(&timing))
+    {
+        return 1;
+    }
+    if (fw_in && flash_sim_load(fw_in, FW_ADDR))
+    {
+        return 1;
+    }
+    if (trace_load_file(argv[optind + 1]))
+    {
+        return 1;
+    }
+
+    msc_ram_init();
+    if (enumerate())
+    {
+        fprintf(stderr, "enumeration failed\n");
+        return 1;
+    }
+
+    // What hosts issue on attach
+    if (bot_simple(SCSI_CMD_INQUIRY, true, 36) //
+        || bot_simple(SCSI_CMD_TESTUNITREADY, false, 0) //
+        || bot_simple(SCSI_CMD_READCAPACITY10, true, 8))
+    {
+        fprintf(stderr, "device not ready\n");
+        return 1;
+    }
+
+    flash_sim_reset_stats();
+    int res = replay(argv[optind]);
+    // As on eject
+    if (0 == res && (bot_poll_unit() || bot_sync_cache()))
+    {
+        res = -1;
+    }
+
+    printf("%s:\n", argv[optind]);
+    print_stats();
+    if (reset_line)
+    {
+        printf("  finished at line %u, %u commands after reset\n", reset_line, commands_after_reset);
+    }
+    else
+    {
+        printf("  not finished\n");
+    }
+    if (unit_sense)
+    {
+        printf("  unit not ready after, sense %06x\n", unit_sense);
+    }
+    flash_sim_print_stats("  flash");
+    host_print_write_stats("  image");
+
+    return res ? 1 : 0;
+}
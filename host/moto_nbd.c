@@ -0,0 +1,279 @@
+// Serves the MOTO volume as a Linux NBD block device.
+//
+// Usage: moto_nbd [-f fw.bin] [-o out.bin] [-P us] [-E us] [-S us] [-r] /dev/nbdN
+//
+//   -f FILE   preload firmware image at FW_ADDR
+//   -o FILE   save firmware region on exit
+//   -P/-E/-S  page program / page erase / sector erase latency, in us
+//   -r        sleep for modeled flash latencies (real-time mode)
+//
+// Requires root and the nbd kernel module (modprobe nbd).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+#include "usb_fs.h"
+#include "dfu.h"
+#include "flash_sim.h"
+#include "host.h"
+
+static int nbd_fd = -1;
+
+static int read_all(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void on_signal(int sig)
+{
+    if (nbd_fd >= 0)
+    {
+        ioctl(nbd_fd, NBD_DISCONNECT);
+    }
+}
+
+static void *nbd_do_it(void *arg)
+{
+    ioctl(nbd_fd, NBD_DO_IT);
+    return NULL;
+}
+
+static void check_reset()
+{
+    if (host_take_reset())
+    {
+        flash_sim_print_stats("reset");
+        flash_sim_reset_stats();
+    }
+}
+
+// Returns 0 if the request was served, 1 on disconnect, -1 on I/O error
+static int serve_request(int sk)
+{
+    static uint32_t sector_buf[SECTOR_SIZE / 4];
+
+    struct nbd_request req;
+    if (read_all(sk, &req, sizeof(req)))
+    {
+        return -1;
+    }
+    if (NBD_REQUEST_MAGIC != ntohl(req.magic))
+    {
+        fprintf(stderr, "bad request magic\n");
+        return -1;
+    }
+
+    const uint32_t type = 0xffff & ntohl(req.type);
+    const uint64_t from = be64toh(req.from);
+    const uint32_t len = ntohl(req.len);
+
+    struct nbd_reply reply = {0};
+    reply.magic = htonl(NBD_REPLY_MAGIC);
+    memcpy(reply.handle, req.handle, sizeof(reply.handle));
+
+    if (NBD_CMD_DISC == type)
+    {
+        return 1;
+    }
+
+    if ((NBD_CMD_READ == type || NBD_CMD_WRITE == type) //
+        && (0 != from % SECTOR_SIZE || 0 != len % SECTOR_SIZE))
+    {
+        reply.error = htonl(22); // EINVAL
+        if (NBD_CMD_WRITE == type)
+        {
+            // Drain the payload to keep the stream in sync
+            for (uint32_t i = 0; i < len; i++)
+            {
+                uint8_t c;
+                if (read_all(sk, &c, 1))
+                {
+                    return -1;
+                }
+            }
+        }
+        return write_all(sk, &reply, sizeof(reply));
+    }
+
+    uint32_t sector = from / SECTOR_SIZE;
+    const uint32_t count = len / SECTOR_SIZE;
+
+    if (NBD_CMD_READ == type)
+    {
+        if (write_all(sk, &reply, sizeof(reply)))
+        {
+            return -1;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            usb_fs_sector_read(sector + i, (uint8_t *)sector_buf, SECTOR_SIZE);
+            if (write_all(sk, sector_buf, SECTOR_SIZE))
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (NBD_CMD_WRITE == type)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (read_all(sk, sector_buf, SECTOR_SIZE))
+            {
+                return -1;
+            }
+            if (!reply.error && usb_fs_sector_write(sector + i, (uint8_t *)sector_buf, SECTOR_SIZE))
+            {
+                reply.error = htonl(5); // EIO
+            }
+            check_reset();
+        }
+        // No main loop here to drain the write cache
+        usb_fs_sync();
+        return write_all(sk, &reply, sizeof(reply));
+    }
+
+    // Flush etc.
+    return write_all(sk, &reply, sizeof(reply));
+}
+
+int main(int argc, char **argv)
+{
+    flash_sim_timing_t timing = {
+        .page_program_us = FLASH_SIM_DEFAULT_PAGE_PROGRAM_US,
+        .page_erase_us = FLASH_SIM_DEFAULT_PAGE_ERASE_US,
+        .sector_erase_us = FLASH_SIM_DEFAULT_SECTOR_ERASE_US,
+        .realtime = false,
+    };
+    const char *fw_in = NULL;
+    const char *fw_out = NULL;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "f:o:P:E:S:r")))
+    {
+        switch (opt)
+        {
+        case 'f':
+            fw_in = optarg;
+            break;
+        case 'o':
+            fw_out = optarg;
+            break;
+        case 'P':
+            timing.page_program_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'E':
+            timing.page_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            timing.sector_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            timing.realtime = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f fw.bin] [-o out.bin] [-P us] [-E us] [-S us] [-r] /dev/nbdN\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "need an nbd device\n");
+        return 1;
+    }
+
+    if (flash_sim_init(&timing))
+    {
+        return 1;
+    }
+    if (fw_in && flash_sim_load(fw_in, FW_ADDR))
+    {
+        return 1;
+    }
+
+    int sk[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sk))
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    nbd_fd = open(argv[optind], O_RDWR);
+    if (nbd_fd < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (ioctl(nbd_fd, NBD_SET_BLKSIZE, (unsigned long)SECTOR_SIZE) //
+        || ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, (unsigned long)SECTOR_NUM) //
+        || ioctl(nbd_fd, NBD_CLEAR_SOCK) //
+        || ioctl(nbd_fd, NBD_SET_SOCK, sk[1]))
+    {
+        perror("nbd ioctl");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    pthread_t th;
+    pthread_create(&th, NULL, nbd_do_it, NULL);
+
+    printf("serving MOTO volume on %s\n", argv[optind]);
+
+    int res;
+    while (0 == (res = serve_request(sk[0])))
+    {
+    }
+
+    ioctl(nbd_fd, NBD_CLEAR_QUE);
+    ioctl(nbd_fd, NBD_CLEAR_SOCK);
+    pthread_join(th, NULL);
+    close(nbd_fd);
+
+    flash_sim_print_stats("exit");
+    if (fw_out && flash_sim_save(fw_out, FW_ADDR, FW_SIZE))
+    {
+        return 1;
+    }
+
+    return res < 0 ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+// Replays a sector trace (see host/mktrace.py) against the DFU stack.
+//
+// Usage: moto_replay [-f fw.bin] [-P us] [-E us] [-S us] trace.csv file.uf2
+//
+//   -f FILE   preload firmware image at FW_ADDR
+//   -P/-E/-S  page program / page erase / sector erase latency, in us
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "usb_fs.h"
+#include "dfu.h"
+#include "flash_sim.h"
+#include "host.h"
+#include "trace.h"
+
+static struct
+{
+    uint32_t commands;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t rejected;
+    uint32_t reset_line;
+    uint32_t commands_after_reset;
+} replay_stats = {0};
+
+static void replay_read(uint32_t lba, uint32_t count)
+{
+    static uint32_t buf[SECTOR_SIZE / 4];
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        usb_fs_sector_read(lba + i, (uint8_t *)buf, SECTOR_SIZE);
+    }
+    replay_stats.sectors_read += count;
+}
+
+// A failed sector fails the whole command, as in usbd_msc
+static void replay_write(const trace_cmd_t *cmd)
+{
+    static uint32_t buf[SECTOR_SIZE / 4];
+
+    for (uint32_t i = 0; i < cmd->count; i++)
+    {
+        trace_get_sector(cmd, i, (uint8_t *)buf);
+
+        replay_stats.sectors_written++;
+        if (usb_fs_sector_write(cmd->lba + i, (uint8_t *)buf, SECTOR_SIZE))
+        {
+            replay_stats.rejected++;
+            return;
+        }
+    }
+}
+
+static int replay(const char *path)
+{
+    trace_t t;
+    if (trace_open(&t, path))
+    {
+        return -1;
+    }
+
+    trace_cmd_t cmd;
+    int res;
+    while (1 == (res = trace_next(&t, &cmd)))
+    {
+        replay_stats.commands++;
+        if (replay_stats.reset_line)
+        {
+            replay_stats.commands_after_reset++;
+        }
+
+        if ('R' == cmd.op)
+        {
+            replay_read(cmd.lba, cmd.count);
+        }
+        else
+        {
+            replay_write(&cmd);
+            // No main loop here to drain the write cache
+            usb_fs_sync();
+        }
+
+        if (host_take_reset() && !replay_stats.reset_line)
+        {
+            replay_stats.reset_line = t.line_no;
+        }
+    }
+
+    trace_close(&t);
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    flash_sim_timing_t timing = {
+        .page_program_us = FLASH_SIM_DEFAULT_PAGE_PROGRAM_US,
+        .page_erase_us = FLASH_SIM_DEFAULT_PAGE_ERASE_US,
+        .sector_erase_us = FLASH_SIM_DEFAULT_SECTOR_ERASE_US,
+        .realtime = false,
+    };
+    const char *fw_in = NULL;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "f:P:E:S:")))
+    {
+        switch (opt)
+        {
+        case 'f':
+            fw_in = optarg;
+            break;
+        case 'P':
+            timing.page_program_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'E':
+            timing.page_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            timing.sector_erase_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "usage: %s [-f fw.bin] [-P us] [-E us] [-S us] trace.csv file.uf2\n", argv[0]);
+        return 1;
+    }
+
+    if (flash_sim_init(&timing))
+    {
+        return 1;
+    }
+    if (fw_in && flash_sim_load(fw_in, FW_ADDR))
+    {
+        return 1;
+    }
+    if (trace_load_file(argv[optind + 1]))
+    {
+        return 1;
+    }
+    if (replay(argv[optind]))
+    {
+        return 1;
+    }
+
+    printf("%s: %u commands, %u sectors read, %u written, %u rejected blocks\n", //
+           argv[optind], replay_stats.commands, replay_stats.sectors_read,       //
+           replay_stats.sectors_written, replay_stats.rejected);
+    if (replay_stats.reset_line)
+    {
+        printf("  finished at line %u, %u commands after reset\n", replay_stats.reset_line, replay_stats.commands_after_reset);
+    }
+    else
+    {
+        printf("  not finished\n");
+    }
+    flash_sim_print_stats("  flash");
+    host_print_write_stats("  image");
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+// Checks of the DFU stack on the simulated flash, run by make host-test.
+//
+// Usage: moto_test [name...]
+//
+// Each test runs in a process of its own, so it starts from blank flash and
+// the DFU code's initial state. Without names, all of them run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "usb_fs.h"
+#include "dfu.h"
+#include "dfu_write.h"
+#include "fat.h"
+#include "crc.h"
+#include "lzss.h"
+#include "fw.h"
+#include "uf2.h"
+#include "internal_flash.h"
+#include "flash_sim.h"
+#include "host.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static uint32_t sector_buf[SECTOR_SIZE / 4];
+
+static const uint8_t *read_sector(uint32_t sector)
+{
+    memset(sector_buf, 0xa5, sizeof(sector_buf));
+    CHECK(0 == usb_fs_sector_read(sector, (uint8_t *)sector_buf, SECTOR_SIZE));
+    return (const uint8_t *)sector_buf;
+}
+
+// First sector after CURRENT.UF2, where hosts allocate a new file
+#define FIRST_FREE_LBA (DATA_SECTOR + CURRENT_UF2_SECTOR + FW_PAGE_NUM)
+
+static bool flash_erased(uint32_t addr, uint32_t size)
+{
+    const uint8_t *p = (const uint8_t *)addr;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (0xff != p[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void init_block(uf2_block_t *block, uint32_t target_addr, uint32_t payload_size, uint32_t block_no, uint32_t num_blocks)
+{
+    memset(block, 0, sizeof(*block));
+    block->magic_start0 = UF2_MAGIC_START0;
+    block->magic_start1 = UF2_MAGIC_START1;
+    block->magic_end = UF2_MAGIC_END;
+    block->target_addr = target_addr;
+    block->payload_size = payload_size;
+    block->block_no = block_no;
+    block->num_blocks = num_blocks;
+    for (uint32_t i = 0; i < payload_size; i++)
+    {
+        block->data[i] = (uint8_t)(target_addr + i * 13 + 1);
+    }
+}
+
+// Byte i of the image write_pages() writes with seed
+static uint8_t page_byte(uint32_t i, uint8_t seed)
+{
+    return (uint8_t)(i * 7 + i / FLASH_PAGE_SIZE) ^ seed;
+}
+
+// Writes the first blocks of an image of whole pages from FW_ADDR up to end,
+// one UF2 block each
+static void write_first_pages(uint32_t end, uint32_t blocks, uint8_t seed)
+{
+    static uf2_block_t block;
+    const uint32_t num_blocks = (end - FW_ADDR) / FLASH_PAGE_SIZE;
+    for (uint32_t i = 0; i < blocks; i++)
+    {
+        init_block(&block, FW_ADDR + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, i, num_blocks);
+        for (uint32_t j = 0; j < FLASH_PAGE_SIZE; j++)
+        {
+            block.data[j] = page_byte(i * FLASH_PAGE_SIZE + j, seed);
+        }
+        CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA + i, (const uint8_t *)&block, SECTOR_SIZE));
+    }
+}
+
+// Writes the whole of that image
+static void write_pages(uint32_t end, uint8_t seed)
+{
+    write_first_pages(end, (end - FW_ADDR) / FLASH_PAGE_SIZE, seed);
+}
+
+// Whether flash from FW_ADDR up to end holds what write_pages() wrote
+static bool pages_written(uint32_t end, uint8_t seed)
+{
+    const uint8_t *p = (const uint8_t *)FW_ADDR;
+    for (uint32_t i = 0; i < end - FW_ADDR; i++)
+    {
+        if (page_byte(i, seed) != p[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_boot_sector()
+{
+    const uint8_t *buf = read_sector(BOOT_SECTOR);
+    CHECK(0xeb == buf[0]);
+    CHECK(0 == memcmp(buf + 3, "MOTO    ", 8));
+    CHECK(0x55 == buf[SECTOR_SIZE - 2] && 0xaa == buf[SECTOR_SIZE - 1]);
+}
+
+// Tests ----------
+
+// The boot sector reads as generated, whatever the host wrote to the FAT and
+// root directory, and after a medium change. Builds with ENABLE_SHADOW read
+// the FAT back as written until then.
+static void test_boot_sector()
+{
+    check_boot_sector();
+
+    static uint8_t buf[SECTOR_SIZE];
+    memset(buf, 0x5a, sizeof(buf));
+    CHECK(0 == usb_fs_sector_write(FAT_SECTOR, buf, SECTOR_SIZE));
+    CHECK(0 == usb_fs_sector_write(ROOT_SECTOR, buf, SECTOR_SIZE));
+    check_boot_sector();
+#if defined(ENABLE_SHADOW)
+    CHECK(0 == memcmp(read_sector(FAT_SECTOR), buf, SECTOR_SIZE));
+#endif
+
+    dfu_medium_changed();
+    check_boot_sector();
+    CHECK(0 != memcmp(read_sector(FAT_SECTOR), buf, SECTOR_SIZE));
+}
+
+#if defined(ENABLE_SHADOW)
+// FAT and root directory sectors read back as the host wrote them. Once
+// DFU_SHADOW_SECTORS are kept, the least recently used one reads as generated
+// again, and all of them do after a medium change.
+static void test_shadow()
+{
+    static uint8_t buf[SECTOR_SIZE];
+    for (uint32_t i = 0; i < DFU_SHADOW_SECTORS; i++)
+    {
+        memset(buf, 0x10 + i, sizeof(buf));
+        CHECK(0 == usb_fs_sector_write(ROOT_SECTOR + i, buf, SECTOR_SIZE));
+    }
+    CHECK(0x10 == read_sector(ROOT_SECTOR)[0]); // Used last now
+    memset(buf, 0x5a, sizeof(buf));
+    CHECK(0 == usb_fs_sector_write(FAT_SECTOR, buf, SECTOR_SIZE));
+
+    CHECK(0 == memcmp(read_sector(FAT_SECTOR), buf, SECTOR_SIZE));
+    CHECK(0x10 == read_sector(ROOT_SECTOR)[0]);
+    CHECK(0x11 != read_sector(ROOT_SECTOR + 1)[0]);
+    for (uint32_t i = 2; i < DFU_SHADOW_SECTORS; i++)
+    {
+        CHECK(0x10 + i == read_sector(ROOT_SECTOR + i)[0]);
+    }
+
+    dfu_medium_changed();
+    CHECK(0x5a != read_sector(FAT_SECTOR)[SECTOR_SIZE - 1]);
+    CHECK(0x10 != read_sector(ROOT_SECTOR)[0]);
+}
+#endif
+
+// A UF2 block of 476 bytes fills a page and part of the next, and a sync
+// programs both, the rest of the second one as it was
+static void test_sync_partial()
+{
+    static uf2_block_t block;
+    init_block(&block, FW_ADDR + FLASH_SECTOR_SIZE, UF2_MAX_PAYLOAD_SIZE, 0, 3);
+    CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA, (const uint8_t *)&block, SECTOR_SIZE));
+    CHECK(0 == usb_fs_sync());
+
+    CHECK(0 == memcmp((const void *)block.target_addr, block.data, UF2_MAX_PAYLOAD_SIZE));
+    CHECK(flash_erased(block.target_addr + UF2_MAX_PAYLOAD_SIZE, SECTOR_SIZE - UF2_MAX_PAYLOAD_SIZE));
+}
+
+// A reset block leaves DFU mode in builds with ENABLE_STAY_IN_DFU, and is
+// ignored by the others
+static void test_reset_block()
+{
+    static uf2_block_t block;
+    init_block(&block, 0, 0, 0, 1);
+    block.flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_RESET;
+    CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA, (const uint8_t *)&block, SECTOR_SIZE));
+#if defined(ENABLE_STAY_IN_DFU)
+    CHECK(0 != host_take_reset());
+#else
+    CHECK(0 == host_take_reset());
+#endif
+}
+
+// An image ending on a sector boundary, with num_blocks counting a sector's
+// worth of blocks more, as if side blocks came at the end: the sector after it
+// is left alone
+static void test_erase_end()
+{
+    const uint32_t image_end = FW_ADDR - FW_ADDR % FLASH_SECTOR_SIZE + 2 * FLASH_SECTOR_SIZE;
+    const uint32_t data_blocks = (image_end - FW_ADDR) / FLASH_PAGE_SIZE;
+    const uint32_t num_blocks = data_blocks + FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE;
+
+    static uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0x3c, sizeof(page));
+    internal_flash_program_page(image_end, page);
+    internal_flash_wait();
+
+    static uf2_block_t block;
+    for (uint32_t i = 0; i < data_blocks; i++)
+    {
+        init_block(&block, FW_ADDR + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, i, num_blocks);
+        CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA + i, (const uint8_t *)&block, SECTOR_SIZE));
+    }
+    CHECK(0 == usb_fs_sync());
+
+    CHECK(0 == memcmp((const void *)(image_end - FLASH_PAGE_SIZE), block.data, FLASH_PAGE_SIZE));
+    CHECK(0 == memcmp((const void *)image_end, page, FLASH_PAGE_SIZE));
+}
+
+// The same image written again programs and erases nothing. A changed one is
+// erased a sector at a time where it covers whole ones, in builds with
+// ENABLE_ERASE_AHEAD.
+static void test_rewrite()
+{
+    const uint32_t end = FW_ADDR - FW_ADDR % FLASH_SECTOR_SIZE + 3 * FLASH_SECTOR_SIZE;
+    write_pages(end, 0);
+    CHECK(pages_written(end, 0));
+
+    flash_sim_stats_t flash;
+    dfu_write_stats_t stats;
+    flash_sim_reset_stats();
+    write_pages(end, 0);
+    flash_sim_get_stats(&flash);
+    dfu_write_get_stats(&stats);
+    CHECK(stats.blocks_received == stats.num_blocks);
+    CHECK(0 == stats.bytes_programmed);
+    CHECK(end - FW_ADDR == stats.bytes_skipped);
+    CHECK(0 == flash.sector_erases);
+
+    flash_sim_reset_stats();
+    write_pages(end, 0x5a);
+    flash_sim_get_stats(&flash);
+    dfu_write_get_stats(&stats);
+    CHECK(end - FW_ADDR == stats.bytes_programmed);
+#if defined(ENABLE_ERASE_AHEAD)
+    CHECK(2 == flash.sector_erases);
+#else
+    CHECK(0 == flash.sector_erases);
+#endif
+    CHECK(pages_written(end, 0x5a));
+}
+
+#if defined(ENABLE_UF2_LZSS)
+// Appends the low n bits of v, MSB first, to an LZSS stream at bit *pos
+static void lzss_put(uint8_t *dst, uint32_t *pos, uint32_t v, uint32_t n)
+{
+    while (n--)
+    {
+        if (v >> n & 1)
+        {
+            dst[*pos / 8] |= 0x80 >> *pos % 8;
+        }
+        (*pos)++;
+    }
+}
+
+// An image of compressed blocks, two pages each, decodes to two bytes
+// repeated through each block: a pair of literals and a run of matches
+static void test_lzss()
+{
+    const uint32_t block_size = 2 * FLASH_PAGE_SIZE;
+    const uint32_t num_blocks = 2;
+    const uint32_t max_len = LZSS_MIN_MATCH + (1 << LZSS_LENGTH_BITS) - 1;
+
+    static uf2_block_t block;
+    for (uint32_t i = 0; i < num_blocks; i++)
+    {
+        init_block(&block, FW_ADDR + i * block_size, 0, i, num_blocks);
+        block.flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_LZSS;
+        uf2_lzss_header_t *const header = (uf2_lzss_header_t *)block.data;
+        header->image_addr = FW_ADDR;
+        header->image_size = num_blocks * block_size;
+
+        uint8_t *const stream = block.data + sizeof(*header);
+        uint32_t pos = 0;
+        lzss_put(stream, &pos, 0x100 | (0x10 + i), 9);
+        lzss_put(stream, &pos, 0x100 | (0xe0 + i), 9);
+        for (uint32_t n = 2; n < block_size;)
+        {
+            const uint32_t len = block_size - n < max_len ? block_size - n : max_len;
+            lzss_put(stream, &pos, 0, 1);
+            lzss_put(stream, &pos, 2 - 1, LZSS_OFFSET_BITS);
+            lzss_put(stream, &pos, len - LZSS_MIN_MATCH, LZSS_LENGTH_BITS);
+            n += len;
+        }
+        block.payload_size = sizeof(*header) + (pos + 7) / 8;
+        CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA + i, (const uint8_t *)&block, SECTOR_SIZE));
+    }
+
+    dfu_write_stats_t stats;
+    dfu_write_get_stats(&stats);
+    CHECK(num_blocks == stats.blocks_received);
+    CHECK(num_blocks * block_size == stats.bytes_programmed);
+    const uint8_t *p = (const uint8_t *)FW_ADDR;
+    uint32_t differ = 0;
+    for (uint32_t i = 0; i < num_blocks * block_size; i++)
+    {
+        differ += (i % 2 ? 0xe0 : 0x10) + i / block_size != p[i];
+    }
+    CHECK(0 == differ);
+    CHECK(flash_erased(FW_ADDR + num_blocks * block_size, FLASH_PAGE_SIZE));
+}
+#endif
+
+#if defined(ENABLE_UF2_FILL)
+// Writes a fill block standing for blocks pages of value, from block_no on
+static void write_fill(uint32_t lba, uint32_t block_no, uint32_t blocks, uint32_t num_blocks, uint8_t value)
+{
+    static uf2_block_t block;
+    init_block(&block, FW_ADDR + block_no * FLASH_PAGE_SIZE, sizeof(uf2_fill_t), block_no, num_blocks);
+    block.flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_FILL;
+    uf2_fill_t *const fill = (uf2_fill_t *)block.data;
+    fill->size = blocks * FLASH_PAGE_SIZE;
+    fill->blocks = blocks;
+    fill->value = value;
+    CHECK(0 == usb_fs_sector_write(lba, (const uint8_t *)&block, SECTOR_SIZE));
+}
+
+// Fill blocks over an image already in flash: a run of one value is
+// programmed, and one of 0xff erases its page
+static void test_fill()
+{
+    const uint32_t num_blocks = 4;
+    const uint32_t end = FW_ADDR + num_blocks * FLASH_PAGE_SIZE;
+    write_pages(end, 0);
+
+    static uf2_block_t block;
+    init_block(&block, FW_ADDR, FLASH_PAGE_SIZE, 0, num_blocks);
+    CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA, (const uint8_t *)&block, SECTOR_SIZE));
+    write_fill(FIRST_FREE_LBA + 1, 1, 2, num_blocks, 0x42);
+    write_fill(FIRST_FREE_LBA + 2, 3, 1, num_blocks, 0xff);
+
+    dfu_write_stats_t stats;
+    dfu_write_get_stats(&stats);
+    CHECK(num_blocks == stats.num_blocks);
+    CHECK(0 == memcmp((const void *)FW_ADDR, block.data, FLASH_PAGE_SIZE));
+    const uint8_t *p = (const uint8_t *)(FW_ADDR + FLASH_PAGE_SIZE);
+    uint32_t differ = 0;
+    for (uint32_t i = 0; i < 2 * FLASH_PAGE_SIZE; i++)
+    {
+        differ += 0x42 != p[i];
+    }
+    CHECK(0 == differ);
+    CHECK(flash_erased(end - FLASH_PAGE_SIZE, FLASH_PAGE_SIZE));
+}
+#endif
+
+#if defined(ENABLE_UF2_VERIFY)
+// Writes an image of two pages followed by a verify block with crc, and
+// returns the result of checking it
+static uint8_t write_verified(uint32_t crc)
+{
+    const uint32_t num_blocks = 3;
+    static uf2_block_t block;
+    for (uint32_t i = 0; i < num_blocks - 1; i++)
+    {
+        init_block(&block, FW_ADDR + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, i, num_blocks);
+        CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA + i, (const uint8_t *)&block, SECTOR_SIZE));
+    }
+
+    init_block(&block, 0, sizeof(uf2_verify_t), num_blocks - 1, num_blocks);
+    block.flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_VERIFY;
+    uf2_verify_t *const record = (uf2_verify_t *)block.data;
+    record->image_addr = FW_ADDR;
+    record->image_size = (num_blocks - 1) * FLASH_PAGE_SIZE;
+    record->image_crc = crc;
+    CHECK(0 == usb_fs_sector_write(FIRST_FREE_LBA + num_blocks - 1, (const uint8_t *)&block, SECTOR_SIZE));
+
+    dfu_verify_t verify;
+    dfu_write_get_verify(&verify);
+    CHECK(FW_ADDR == verify.image_addr);
+    CHECK(record->image_size == verify.image_size);
+    CHECK(crc == verify.expected_crc);
+    return verify.result;
+}
+
+// An image with a verify block passes once written if the CRC matches what is
+// in flash, and fails if not
+static void test_verify()
+{
+    static uint8_t image[2 * FLASH_PAGE_SIZE];
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        static uf2_block_t block;
+        init_block(&block, FW_ADDR + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, i, 3);
+        memcpy(image + i * FLASH_PAGE_SIZE, block.data, FLASH_PAGE_SIZE);
+    }
+    const uint32_t crc = crc_compute_buf(image, sizeof(image));
+
+    CHECK(DFU_VERIFY_PASS == write_verified(crc));
+    CHECK(0 == memcmp((const void *)FW_ADDR, image, sizeof(image)));
+    CHECK(DFU_VERIFY_FAIL == write_verified(crc ^ 1));
+}
+#endif
+
+#if defined(ENABLE_RESUME)
+// A copy cut short by a power loss after 48 pages, then the same image
+// copied again: the pages in the journal are skipped, and the journal is erased once done. The
+// copy cut short runs in a child process, whose flash is saved to a file.
+static void test_resume()
+{
+    const uint32_t end = FW_ADDR + 64 * FLASH_PAGE_SIZE;
+    char path[] = "/tmp/moto_test.XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (0 == pid)
+    {
+        write_first_pages(end, 48, 0);
+        exit(failures || flash_sim_save(path, JOURNAL_ADDR, end - JOURNAL_ADDR) ? 1 : 0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    CHECK(0 == flash_sim_load(path, JOURNAL_ADDR));
+    unlink(path);
+
+    write_pages(end, 0);
+    dfu_write_stats_t stats;
+    dfu_write_get_stats(&stats);
+    // Saved after the first 32 pages, the ones after them are programmed again
+    // or found identical
+    CHECK(32 == stats.blocks_resumed);
+    CHECK(stats.num_blocks == stats.blocks_received);
+    CHECK(end - FW_ADDR - 32 * FLASH_PAGE_SIZE == stats.bytes_programmed + stats.bytes_skipped);
+    CHECK(pages_written(end, 0));
+    CHECK(flash_erased(JOURNAL_ADDR, FLASH_PAGE_SIZE));
+}
+#endif
+
+static const struct
+{
+    const char *name;
+    void (*run)();
+} tests[] = {
+    {"boot_sector", test_boot_sector},
+#if defined(ENABLE_SHADOW)
+    {"shadow", test_shadow},
+#endif
+    {"sync_partial", test_sync_partial},
+    {"erase_end", test_erase_end},
+    {"reset_block", test_reset_block},
+    {"rewrite", test_rewrite},
+#if defined(ENABLE_UF2_LZSS)
+    {"lzss", test_lzss},
+#endif
+#if defined(ENABLE_UF2_FILL)
+    {"fill", test_fill},
+#endif
+#if defined(ENABLE_UF2_VERIFY)
+    {"verify", test_verify},
+#endif
+#if defined(ENABLE_RESUME)
+    {"resume", test_resume},
+#endif
+};
+
+#define TEST_NUM (sizeof(tests) / sizeof(tests[0]))
+
+static int run_test(uint32_t i)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (0 == pid)
+    {
+        flash_sim_timing_t timing = {0};
+        if (flash_sim_init(&timing))
+        {
+            exit(2);
+        }
+        tests[i].run();
+        exit(failures ? 1 : 0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    const bool pass = WIFEXITED(status) && 0 == WEXITSTATUS(status);
+    printf("%s: %s\n", tests[i].name, pass ? "pass" : "FAIL");
+    return pass ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    if (argc < 2)
+    {
+        for (uint32_t i = 0; i < TEST_NUM; i++)
+        {
+            failed += run_test(i);
+        }
+    }
+    for (int a = 1; a < argc; a++)
+    {
+        uint32_t i = 0;
+        while (i < TEST_NUM && strcmp(tests[i].name, argv[a]))
+        {
+            i++;
+        }
+        if (TEST_NUM == i)
+        {
+            fprintf(stderr, "no test %s\n", argv[a]);
+            return 1;
+        }
+        failed += run_test(i);
+    }
+
+    printf("%d failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+#include "trace.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfu.h"
+
+// First sector after CURRENT.UF2, where hosts allocate a new file on a fresh volume
+#define FIRST_FREE_LBA (DATA_SECTOR + CURRENT_UF2_SECTOR + FW_PAGE_NUM)
+
+static uint8_t *file_buf = NULL;
+static uint32_t file_sectors = 0;
+static uint32_t file_size = 0;
+static char file_name[11]; // 8.3, as in the directory entry
+
+// Where the trace puts file sector 0, -1 if it writes none
+static int32_t file_lba = -1;
+
+int trace_open(trace_t *t, const char *path)
+{
+    t->f = fopen(path, "r");
+    if (!t->f)
+    {
+        perror(path);
+        return -1;
+    }
+    t->path = path;
+    t->line_no = 0;
+
+    // Metadata written ahead of the data still points at it
+    trace_cmd_t cmd;
+    file_lba = -1;
+    while (1 == trace_next(t, &cmd))
+    {
+        if ('W' == cmd.op && cmd.file_sector >= 0)
+        {
+            file_lba = cmd.lba - cmd.file_sector;
+            break;
+        }
+    }
+    rewind(t->f);
+    t->line_no = 0;
+    return 0;
+}
+
+int trace_next(trace_t *t, trace_cmd_t *cmd)
+{
+    char line[128];
+    while (fgets(line, sizeof(line), t->f))
+    {
+        t->line_no++;
+        if ('#' == line[0] || '\n' == line[0] || '\r' == line[0])
+        {
+            continue;
+        }
+
+        int n = sscanf(line, "%c,%u,%u,%d", &cmd->op, &cmd->lba, &cmd->count, &cmd->file_sector);
+        if (n < 3 || ('R' != cmd->op && 'W' != cmd->op))
+        {
+            fprintf(stderr, "%s:%u: bad line\n", t->path, t->line_no);
+            return -1;
+        }
+        if (n < 4)
+        {
+            // No mapping: assume contiguous allocation from the first free cluster
+            cmd->file_sector = (cmd->lba >= FIRST_FREE_LBA) ? (int32_t)(cmd->lba - FIRST_FREE_LBA) : -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void trace_close(trace_t *t)
+{
+    fclose(t->f);
+    t->f = NULL;
+}
+
+int trace_load_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    file_size = size;
+    file_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    file_buf = calloc(file_sectors, SECTOR_SIZE);
+    if (!file_buf || size != (long)fread(file_buf, 1, size, f))
+    {
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *ext = strrchr(base, '.');
+    if (!ext)
+    {
+        ext = base + strlen(base);
+    }
+    memset(file_name, ' ', sizeof(file_name));
+    for (int i = 0; i < 8 && base + i < ext; i++)
+    {
+        const char c = toupper((unsigned char)base[i]);
+        file_name[i] = (isalnum((unsigned char)c) || strchr("!#$%&'()-@^_`{}~", c)) ? c : '_';
+    }
+    for (int i = 0; i < 3 && ext[0] && ext[1 + i]; i++)
+    {
+        file_name[8 + i] = toupper((unsigned char)ext[1 + i]);
+    }
+    return 0;
+}
+
+// The file's cluster chain and directory entry (first in the root directory)
+// as they are once the copy is done. Hosts write these early as well, but
+// never get them wrong, so this is close enough for the DFU stack.
+static void get_metadata(uint32_t lba, uint8_t *buf)
+{
+    if (file_lba < 0)
+    {
+        return;
+    }
+    const uint32_t first = DATA_SECTOR_TO_FAT_ENTRY(file_lba - DATA_SECTOR);
+
+    if (FAT_SECTOR <= lba && lba < ROOT_SECTOR)
+    {
+        for (uint32_t i = 0; i < FAT_ENTRIES_PER_SECTOR; i++)
+        {
+            const uint32_t cluster = (lba - FAT_SECTOR) * FAT_ENTRIES_PER_SECTOR + i;
+            if (cluster >= first && cluster < first + file_sectors)
+            {
+                fat_set_word(buf + FAT_ENTRY_SIZE * i, cluster + 1 < first + file_sectors ? cluster + 1 : FAT16_ENTRY_EOF);
+            }
+        }
+    }
+    else if (ROOT_SECTOR == lba)
+    {
+        fat_dir_entry_t *const entry = (fat_dir_entry_t *)buf;
+        memcpy(entry->name, file_name, sizeof(entry->name));
+        entry->attr = FAT_DIR_ATTR_ARCHIVE;
+        entry->first_clusterLO = first;
+        entry->file_size = file_size;
+    }
+}
+
+void trace_get_sector(const trace_cmd_t *cmd, uint32_t i, uint8_t *buf)
+{
+    memset(buf, 0, SECTOR_SIZE);
+    if (cmd->file_sector >= 0 && (uint32_t)cmd->file_sector + i < file_sectors)
+    {
+        memcpy(buf, file_buf + SECTOR_SIZE * (cmd->file_sector + i), SECTOR_SIZE);
+    }
+    else if (cmd->file_sector < 0)
+    {
+        get_metadata(cmd->lba + i, buf);
+    }
+}
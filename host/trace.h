@@ -0,0 +1,34 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// One command of a sector trace, see host/mktrace.py
+typedef struct
+{
+    char op; // 'R' or 'W'
+    uint32_t lba;
+    uint32_t count;
+    int32_t file_sector; // Source of write data in the copied file, -1 for metadata
+} trace_cmd_t;
+
+typedef struct
+{
+    FILE *f;
+    const char *path;
+    uint32_t line_no;
+} trace_t;
+
+int trace_open(trace_t *t, const char *path);
+// Returns 1 if a command was read, 0 at end of trace, -1 on error
+int trace_next(trace_t *t, trace_cmd_t *cmd);
+void trace_close(trace_t *t);
+
+// Loads the file whose sectors the trace writes
+int trace_load_file(const char *path);
+// Fills the data of the i-th sector written by cmd. Metadata sectors get the
+// file's directory entry and FAT chain.
+void trace_get_sector(const trace_cmd_t *cmd, uint32_t i, uint8_t *buf);
+
+#endif // _TRACE_H
@@ -0,0 +1,322 @@
+// Simulated CherryUSB device controller port.
+//
+// Implements the usb_dc.h API on top of a bus driven by host code (see
+// usb_sim.h), so the unmodified core, MSC class and usbd_msc_impl.c run on
+// Linux. Transfers follow the generic port semantics: a transfer armed with
+// usbd_ep_start_write/read completes on the last (or a short) packet.
+
+#include <string.h>
+#include <time.h>
+#include "usbd_core.h"
+#include "usb_sim.h"
+
+#define USB_SIM_NUM_ENDPOINTS 8
+
+typedef struct
+{
+    uint16_t ep_mps;
+    uint8_t ep_enable;
+    uint8_t ep_stalled;
+    uint8_t busy; // A transfer is armed
+    uint8_t *xfer_buf;
+    uint32_t xfer_len;
+    uint32_t actual_xfer_len;
+} usb_sim_ep_t;
+
+static struct
+{
+    uint8_t dev_addr;
+    usb_sim_ep_t in_ep[USB_SIM_NUM_ENDPOINTS];
+    usb_sim_ep_t out_ep[USB_SIM_NUM_ENDPOINTS];
+} sim_udc;
+
+static usb_sim_stats_t sim_stats = {0};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Device stack entry points, timed as ISR time
+#define DEVICE_CALL(call)                          \
+    do                                             \
+    {                                              \
+        uint64_t t0 = now_ns();                    \
+        call;                                      \
+        sim_stats.device_ns += now_ns() - t0;      \
+    } while (0)
+
+static usb_sim_ep_t *get_ep(uint8_t ep)
+{
+    uint8_t idx = USB_EP_GET_IDX(ep);
+    if (idx >= USB_SIM_NUM_ENDPOINTS)
+    {
+        return NULL;
+    }
+    return USB_EP_DIR_IS_OUT(ep) ? &sim_udc.out_ep[idx] : &sim_udc.in_ep[idx];
+}
+
+// Device side ----------
+
+int usb_dc_init(void)
+{
+    memset(&sim_udc, 0, sizeof(sim_udc));
+    return 0;
+}
+
+int usb_dc_deinit(void)
+{
+    return 0;
+}
+
+int usbd_set_address(const uint8_t addr)
+{
+    sim_udc.dev_addr = addr;
+    return 0;
+}
+
+int usbd_ep_open(const struct usbd_endpoint_cfg *ep_cfg)
+{
+    usb_sim_ep_t *p = get_ep(ep_cfg->ep_addr);
+    if (!p)
+    {
+        return -1;
+    }
+    memset(p, 0, sizeof(*p));
+    p->ep_mps = ep_cfg->ep_mps;
+    p->ep_enable = true;
+    return 0;
+}
+
+int usbd_ep_close(const uint8_t ep)
+{
+    usb_sim_ep_t *p = get_ep(ep);
+    if (p)
+    {
+        p->ep_enable = false;
+        p->busy = false;
+    }
+    return 0;
+}
+
+int usbd_ep_set_stall(const uint8_t ep)
+{
+    if (0 == USB_EP_GET_IDX(ep))
+    {
+        // Protocol stall, lasts until the next SETUP
+        sim_udc.in_ep[0].ep_stalled = true;
+        sim_udc.out_ep[0].ep_stalled = true;
+        return 0;
+    }
+    usb_sim_ep_t *p = get_ep(ep);
+    if (p)
+    {
+        p->ep_stalled = true;
+    }
+    return 0;
+}
+
+int usbd_ep_clear_stall(const uint8_t ep)
+{
+    usb_sim_ep_t *p = get_ep(ep);
+    if (p)
+    {
+        p->ep_stalled = false;
+    }
+    return 0;
+}
+
+int usbd_ep_is_stalled(const uint8_t ep, uint8_t *stalled)
+{
+    usb_sim_ep_t *p = get_ep(ep);
+    *stalled = p ? p->ep_stalled : 0;
+    return 0;
+}
+
+static int start_xfer(usb_sim_ep_t *p, const uint8_t *data, uint32_t data_len)
+{
+    if (!data && data_len)
+    {
+        return -1;
+    }
+    if (!p || !p->ep_enable)
+    {
+        return -2;
+    }
+    p->xfer_buf = (uint8_t *)data;
+    p->xfer_len = data_len;
+    p->actual_xfer_len = 0;
+    p->busy = true;
+    return 0;
+}
+
+int usbd_ep_start_write(const uint8_t ep, const uint8_t *data, uint32_t data_len)
+{
+    return start_xfer(get_ep(ep | 0x80), data, data_len);
+}
+
+int usbd_ep_start_read(const uint8_t ep, uint8_t *data, uint32_t data_len)
+{
+    return start_xfer(get_ep(ep & 0x7f), data, data_len);
+}
+
+void usbd_ep0_set_zlp_flag(void)
+{
+}
+
+void usbd_ep0_reset_zlp_flag(void)
+{
+}
+
+void usbd_activateremotewakeup(void)
+{
+}
+
+void usbd_deactivateremotewakeup(void)
+{
+}
+
+// Host side ----------
+
+void usb_sim_bus_reset()
+{
+    memset(&sim_udc, 0, sizeof(sim_udc));
+    DEVICE_CALL(usbd_event_reset_handler());
+}
+
+int usb_sim_in(uint8_t ep, uint8_t *buf)
+{
+    usb_sim_ep_t *p = get_ep(ep | 0x80);
+    if (!p || !p->ep_enable)
+    {
+        return USB_SIM_STALL;
+    }
+    if (p->ep_stalled)
+    {
+        sim_stats.stalls++;
+        return USB_SIM_STALL;
+    }
+    if (!p->busy)
+    {
+        sim_stats.naks++;
+        return USB_SIM_NAK;
+    }
+
+    uint32_t n = p->xfer_len - p->actual_xfer_len;
+    if (n > p->ep_mps)
+    {
+        n = p->ep_mps;
+    }
+    memcpy(buf, p->xfer_buf + p->actual_xfer_len, n);
+    p->actual_xfer_len += n;
+    sim_stats.in_packets++;
+
+    if (p->actual_xfer_len == p->xfer_len)
+    {
+        p->busy = false;
+        DEVICE_CALL(usbd_event_ep_in_complete_handler(ep | 0x80, p->actual_xfer_len));
+    }
+    return n;
+}
+
+int usb_sim_out(uint8_t ep, const uint8_t *buf, uint32_t len)
+{
+    usb_sim_ep_t *p = get_ep(ep & 0x7f);
+    if (!p || !p->ep_enable)
+    {
+        return USB_SIM_STALL;
+    }
+    if (p->ep_stalled)
+    {
+        sim_stats.stalls++;
+        return USB_SIM_STALL;
+    }
+    if (!p->busy)
+    {
+        sim_stats.naks++;
+        return USB_SIM_NAK;
+    }
+
+    // The controller drops whatever does not fit the armed buffer
+    uint32_t n = p->xfer_len - p->actual_xfer_len;
+    if (n > len)
+    {
+        n = len;
+    }
+    memcpy(p->xfer_buf + p->actual_xfer_len, buf, n);
+    p->actual_xfer_len += n;
+    sim_stats.out_packets++;
+
+    if (len < p->ep_mps || p->actual_xfer_len == p->xfer_len)
+    {
+        p->busy = false;
+        DEVICE_CALL(usbd_event_ep_out_complete_handler(ep & 0x7f, p->actual_xfer_len));
+    }
+    return len;
+}
+
+int usb_sim_control(const struct usb_setup_packet *setup, uint8_t *data)
+{
+    sim_udc.in_ep[0].ep_stalled = false;
+    sim_udc.out_ep[0].ep_stalled = false;
+    sim_udc.in_ep[0].busy = false;
+    sim_udc.out_ep[0].busy = false;
+
+    sim_stats.setups++;
+    DEVICE_CALL(usbd_event_ep0_setup_complete_handler((uint8_t *)setup));
+
+    int res;
+    uint32_t len = 0;
+    if (setup->bmRequestType & USB_REQUEST_DIR_IN)
+    {
+        while (len < setup->wLength)
+        {
+            res = usb_sim_in(0x80, data + len);
+            if (res < 0)
+            {
+                return res == USB_SIM_NAK ? USB_SIM_STALL : res;
+            }
+            len += res;
+            if (res < USB_CTRL_EP_MPS)
+            {
+                break;
+            }
+        }
+        // Status stage: the controller acks it even if the stack has not
+        // armed EP0 OUT yet
+        res = usb_sim_out(0x00, NULL, 0);
+        return USB_SIM_STALL == res ? res : (int)len;
+    }
+
+    while (len < setup->wLength)
+    {
+        uint32_t n = setup->wLength - len;
+        if (n > USB_CTRL_EP_MPS)
+        {
+            n = USB_CTRL_EP_MPS;
+        }
+        res = usb_sim_out(0x00, data + len, n);
+        if (res < 0)
+        {
+            return res == USB_SIM_NAK ? USB_SIM_STALL : res;
+        }
+        len += n;
+    }
+
+    // Status stage, a ZLP from the device
+    uint8_t zlp[USB_CTRL_EP_MPS];
+    res = usb_sim_in(0x80, zlp);
+    return res < 0 ? USB_SIM_STALL : (int)len;
+}
+
+void usb_sim_get_stats(usb_sim_stats_t *stats)
+{
+    *stats = sim_stats;
+}
+
+void usb_sim_reset_stats()
+{
+    memset(&sim_stats, 0, sizeof(sim_stats));
+}
@@ -0,0 +1,120 @@
+// Bare-metal OSAL (usb_osal_baremetal.c) on Linux: the same single
+// cooperative thread, switched with ucontext instead of the M0+ register
+// swap. usb_osal_run() is called where the firmware main loop would.
+
+#include <ucontext.h>
+#include "usb_config.h"
+#include "usb_osal.h"
+#include "usb_errno.h"
+
+#ifndef CONFIG_USB_OSAL_STACKSIZE
+#define CONFIG_USB_OSAL_STACKSIZE 1024
+#endif
+
+// Host code needs more stack than the MCU
+#define SIM_STACK_SIZE (64 * 1024)
+
+#ifndef CONFIG_USB_OSAL_MAX_SEMS
+#define CONFIG_USB_OSAL_MAX_SEMS 1
+#endif
+
+typedef struct
+{
+    volatile uint32_t count;
+} bm_sem_t;
+
+static struct
+{
+    ucontext_t ctx;
+    const bm_sem_t *wait;
+    usb_thread_entry_t entry;
+    void *args;
+} thread;
+
+static ucontext_t main_ctx;
+static uint8_t thread_stack[SIM_STACK_SIZE];
+
+static bm_sem_t sems[CONFIG_USB_OSAL_MAX_SEMS];
+static uint32_t sems_used = 0;
+
+static void thread_start()
+{
+    thread.entry(thread.args);
+    while (1)
+    {
+        swapcontext(&thread.ctx, &main_ctx);
+    }
+}
+
+usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
+{
+    if (thread.entry || stack_size > CONFIG_USB_OSAL_STACKSIZE)
+    {
+        return NULL;
+    }
+
+    thread.entry = entry;
+    thread.args = args;
+
+    getcontext(&thread.ctx);
+    thread.ctx.uc_stack.ss_sp = thread_stack;
+    thread.ctx.uc_stack.ss_size = sizeof(thread_stack);
+    thread.ctx.uc_link = NULL;
+    makecontext(&thread.ctx, thread_start, 0);
+    return &thread;
+}
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
+{
+    if (sems_used >= CONFIG_USB_OSAL_MAX_SEMS)
+    {
+        return NULL;
+    }
+    bm_sem_t *sem = &sems[sems_used++];
+    sem->count = initial_count;
+    return sem;
+}
+
+// The simulated bus runs the "ISR" synchronously, so there is nothing to
+// mask here
+
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout)
+{
+    bm_sem_t *s = sem;
+    while (!s->count)
+    {
+        if (0 == timeout)
+        {
+            return -ETIMEDOUT;
+        }
+        thread.wait = s;
+        swapcontext(&thread.ctx, &main_ctx);
+    }
+    s->count--;
+    return 0;
+}
+
+int usb_osal_sem_give(usb_osal_sem_t sem)
+{
+    ((bm_sem_t *)sem)->count++;
+    return 0;
+}
+
+size_t usb_osal_enter_critical_section(void)
+{
+    return 0;
+}
+
+void usb_osal_leave_critical_section(size_t flag)
+{
+}
+
+void usb_osal_run(void)
+{
+    if (!thread.entry || (thread.wait && !thread.wait->count))
+    {
+        return;
+    }
+    thread.wait = NULL;
+    swapcontext(&main_ctx, &thread.ctx);
+}
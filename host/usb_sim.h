@@ -0,0 +1,38 @@
+#ifndef _USB_SIM_H
+#define _USB_SIM_H
+
+#include <stdint.h>
+#include "usb_def.h"
+
+// Handshakes returned instead of a byte count
+#define USB_SIM_NAK (-1)
+#define USB_SIM_STALL (-2)
+
+// Full-speed bulk fits about 19 max-size packets in a 1 ms frame
+#define USB_SIM_PACKET_US 53
+
+typedef struct
+{
+    uint32_t setups;
+    uint32_t in_packets;  // Data packets sent by the device, incl. ZLPs
+    uint32_t out_packets; // Data packets accepted by the device
+    uint32_t naks;
+    uint32_t stalls;
+    uint64_t device_ns; // Time spent in the device stack, i.e. in its "ISR"
+} usb_sim_stats_t;
+
+// Host side of the simulated bus. Each call is one transaction; the device
+// stack runs synchronously inside it, as it would in USB_IRQHandler.
+
+void usb_sim_bus_reset();
+// Runs a whole control transfer, returns the data stage length or USB_SIM_STALL
+int usb_sim_control(const struct usb_setup_packet *setup, uint8_t *data);
+// One IN token: returns the packet length, USB_SIM_NAK or USB_SIM_STALL
+int usb_sim_in(uint8_t ep, uint8_t *buf);
+// One OUT token: returns len, USB_SIM_NAK or USB_SIM_STALL
+int usb_sim_out(uint8_t ep, const uint8_t *buf, uint32_t len);
+
+void usb_sim_get_stats(usb_sim_stats_t *stats);
+void usb_sim_reset_stats();
+
+#endif // _USB_SIM_H
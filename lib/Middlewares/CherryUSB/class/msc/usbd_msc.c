@@ -13,6 +13,8 @@
 #define MSC_THREAD_OP_READ_MEM   1
 #define MSC_THREAD_OP_WRITE_MEM  2
 #define MSC_THREAD_OP_WRITE_DONE 3
+#define MSC_THREAD_OP_SYNC_CACHE 4
+#define MSC_THREAD_OP_EJECT      5
 
 #define MSD_OUT_EP_IDX 0
 #define MSD_IN_EP_IDX  1
@@ -54,6 +56,16 @@ static volatile uint8_t thread_op;
 static usb_osal_sem_t msc_sem;
 static usb_osal_thread_t msc_thread;
 static volatile uint32_t current_byte_read;
+
+/* Commands without data that call into the storage (sync cache, eject) run
+ * in the thread too, which sends their CSW: the storage code is in flash,
+ * and the interrupt must not wait for it while the flash is busy. */
+static void usbd_msc_thread_command(uint8_t op)
+{
+    usbd_msc_cfg.stage = MSC_SEND_CSW;
+    thread_op = op;
+    usb_osal_sem_give(msc_sem);
+}
 #endif
 
 static void usbd_msc_reset(void)
@@ -163,12 +175,20 @@ static void SCSI_SetSenseData(uint32_t KCQ)
  *
  */
 
+/* Unit attention: after the medium changed, the next TEST UNIT READY fails
+ * with NOT READY TO READY CHANGE, MEDIUM MAY HAVE CHANGED, or REQUEST SENSE
+ * reports it if that comes first. Hosts poll with TEST UNIT READY, and re-read
+ * the volume once they see it. Other commands leave it pending. */
 static bool SCSI_testUnitReady(uint8_t **data, uint32_t *len)
 {
     if (usbd_msc_cfg.cbw.dDataLength != 0U) {
         SCSI_SetSenseData(SCSI_KCQIR_INVALIDCOMMAND);
         return false;
     }
+    if (usbd_msc_unit_attention(usbd_msc_cfg.cbw.bLUN)) {
+        SCSI_SetSenseData(SCSI_KCQUA_NOTREADYTOTRANSITION);
+        return false;
+    }
     *data = NULL;
     *len = 0;
     return true;
@@ -185,6 +205,9 @@ static bool SCSI_requestSense(uint8_t **data, uint32_t *len)
     if (usbd_msc_cfg.cbw.CB[4] < SCSIRESP_FIXEDSENSEDATA_SIZEOF) {
         data_len = usbd_msc_cfg.cbw.CB[4];
     }
+    if (usbd_msc_unit_attention(usbd_msc_cfg.cbw.bLUN)) {
+        SCSI_SetSenseData(SCSI_KCQUA_NOTREADYTOTRANSITION);
+    }
 
     uint8_t request_sense[SCSIRESP_FIXEDSENSEDATA_SIZEOF] = {
         0x70,
@@ -323,6 +346,15 @@ static bool SCSI_startStopUnit(uint8_t **data, uint32_t *len)
     } else if ((usbd_msc_cfg.cbw.CB[4] & 0x3U) == 0x2U) /* START=0 and LOEJ Load Eject=1 */
     {
         //SCSI_MEDIUM_EJECTED;
+#ifdef CONFIG_USBDEV_MSC_THREAD
+        usbd_msc_thread_command(MSC_THREAD_OP_EJECT);
+        return true;
+#else
+        if (usbd_msc_eject(usbd_msc_cfg.cbw.bLUN) != 0) {
+            SCSI_SetSenseData(SCSI_KCQIR_MEDIUMREMOVALPREVENTED);
+            return false;
+        }
+#endif
     } else if ((usbd_msc_cfg.cbw.CB[4] & 0x3U) == 0x3U) /* START=1 and LOEJ Load Eject=1 */
     {
         //SCSI_MEDIUM_UNLOCKED;
@@ -469,36 +501,33 @@ static bool SCSI_readCapacity10(uint8_t **data, uint32_t *len)
     return true;
 }
 
-static bool SCSI_read10(uint8_t **data, uint32_t *len)
+static bool SCSI_synchronizeCache10(uint8_t **data, uint32_t *len)
 {
-    if (((usbd_msc_cfg.cbw.bmFlags & 0x80U) != 0x80U) || (usbd_msc_cfg.cbw.dDataLength == 0U)) {
+    if (usbd_msc_cfg.cbw.dDataLength != 0U) {
         SCSI_SetSenseData(SCSI_KCQIR_INVALIDCOMMAND);
         return false;
     }
-
-    usbd_msc_cfg.start_sector = GET_BE32(&usbd_msc_cfg.cbw.CB[2]); /* Logical Block Address of First Block */
-    USB_LOG_DBG("lba: 0x%04x\r\n", usbd_msc_cfg.start_sector);
-
-    usbd_msc_cfg.nsectors = GET_BE16(&usbd_msc_cfg.cbw.CB[7]); /* Number of Blocks to transfer */
-    USB_LOG_DBG("nsectors: 0x%02x\r\n", usbd_msc_cfg.nsectors);
-
-    if ((usbd_msc_cfg.start_sector + usbd_msc_cfg.nsectors) > usbd_msc_cfg.scsi_blk_nbr) {
-        SCSI_SetSenseData(SCSI_KCQIR_LBAOUTOFRANGE);
-        USB_LOG_ERR("LBA out of range\r\n");
-        return false;
-    }
-
-    if (usbd_msc_cfg.cbw.dDataLength != (usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size)) {
-        USB_LOG_ERR("scsi_blk_len does not match with dDataLength\r\n");
+#ifdef CONFIG_USBDEV_MSC_THREAD
+    usbd_msc_thread_command(MSC_THREAD_OP_SYNC_CACHE);
+    return true;
+#else
+    if (usbd_msc_sync_cache(usbd_msc_cfg.cbw.bLUN) != 0) {
+        SCSI_SetSenseData(SCSI_KCQHE_WRITEFAULT);
         return false;
     }
-    usbd_msc_cfg.stage = MSC_DATA_IN;
-    return SCSI_processRead();
+#endif
+    *data = NULL;
+    *len = 0;
+    return true;
 }
 
-static bool SCSI_read12(uint8_t **data, uint32_t *len)
+/* READ(10), READ(12), WRITE(10) and WRITE(12) differ in the direction and the
+   size of the transfer length only, so share one handler to reduce code size */
+static bool SCSI_readWrite(void)
 {
-    if (((usbd_msc_cfg.cbw.bmFlags & 0x80U) != 0x80U) || (usbd_msc_cfg.cbw.dDataLength == 0U)) {
+    const bool read = (usbd_msc_cfg.cbw.CB[0] & 0x02U) == 0U;
+    uint32_t data_len = 0;
+    if (((usbd_msc_cfg.cbw.bmFlags & 0x80U) != (read ? 0x80U : 0x00U)) || (usbd_msc_cfg.cbw.dDataLength == 0U)) {
         SCSI_SetSenseData(SCSI_KCQIR_INVALIDCOMMAND);
         return false;
     }
@@ -506,7 +535,11 @@ static bool SCSI_read12(uint8_t **data, uint32_t *len)
     usbd_msc_cfg.start_sector = GET_BE32(&usbd_msc_cfg.cbw.CB[2]); /* Logical Block Address of First Block */
     USB_LOG_DBG("lba: 0x%04x\r\n", usbd_msc_cfg.start_sector);
 
-    usbd_msc_cfg.nsectors = GET_BE32(&usbd_msc_cfg.cbw.CB[6]); /* Number of Blocks to transfer */
+    if (usbd_msc_cfg.cbw.CB[0] & 0x80U) {
+        usbd_msc_cfg.nsectors = GET_BE32(&usbd_msc_cfg.cbw.CB[6]); /* Number of Blocks to transfer */
+    } else {
+        usbd_msc_cfg.nsectors = GET_BE16(&usbd_msc_cfg.cbw.CB[7]);
+    }
     USB_LOG_DBG("nsectors: 0x%02x\r\n", usbd_msc_cfg.nsectors);
 
     if ((usbd_msc_cfg.start_sector + usbd_msc_cfg.nsectors) > usbd_msc_cfg.scsi_blk_nbr) {
@@ -515,71 +548,21 @@ static bool SCSI_read12(uint8_t **data, uint32_t *len)
         return false;
     }
 
-    if (usbd_msc_cfg.cbw.dDataLength != (usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size)) {
-        USB_LOG_ERR("scsi_blk_len does not match with dDataLength\r\n");
-        return false;
-    }
-    usbd_msc_cfg.stage = MSC_DATA_IN;
-    return SCSI_processRead();
-}
-
-static bool SCSI_write10(uint8_t **data, uint32_t *len)
-{
-    uint32_t data_len = 0;
-    if (((usbd_msc_cfg.cbw.bmFlags & 0x80U) != 0x00U) || (usbd_msc_cfg.cbw.dDataLength == 0U)) {
-        SCSI_SetSenseData(SCSI_KCQIR_INVALIDCOMMAND);
-        return false;
-    }
-
-    usbd_msc_cfg.start_sector = GET_BE32(&usbd_msc_cfg.cbw.CB[2]); /* Logical Block Address of First Block */
-    USB_LOG_DBG("lba: 0x%04x\r\n", usbd_msc_cfg.start_sector);
-
-    usbd_msc_cfg.nsectors = GET_BE16(&usbd_msc_cfg.cbw.CB[7]); /* Number of Blocks to transfer */
-    USB_LOG_DBG("nsectors: 0x%02x\r\n", usbd_msc_cfg.nsectors);
-
     data_len = usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size;
-    if ((usbd_msc_cfg.start_sector + usbd_msc_cfg.nsectors) > usbd_msc_cfg.scsi_blk_nbr) {
-        USB_LOG_ERR("LBA out of range\r\n");
-        return false;
-    }
-
     if (usbd_msc_cfg.cbw.dDataLength != data_len) {
+        USB_LOG_ERR("scsi_blk_len does not match with dDataLength\r\n");
         return false;
     }
-    usbd_msc_cfg.stage = MSC_DATA_OUT;
-    data_len = MIN(data_len, CONFIG_USBDEV_MSC_BLOCK_SIZE);
-    usbd_ep_start_read(mass_ep_data[MSD_OUT_EP_IDX].ep_addr, usbd_msc_cfg.block_buffer, data_len);
-    return true;
-}
-
-static bool SCSI_write12(uint8_t **data, uint32_t *len)
-{
-    uint32_t data_len = 0;
-    if (((usbd_msc_cfg.cbw.bmFlags & 0x80U) != 0x00U) || (usbd_msc_cfg.cbw.dDataLength == 0U)) {
-        SCSI_SetSenseData(SCSI_KCQIR_INVALIDCOMMAND);
-        return false;
-    }
-
-    usbd_msc_cfg.start_sector = GET_BE32(&usbd_msc_cfg.cbw.CB[2]); /* Logical Block Address of First Block */
-    USB_LOG_DBG("lba: 0x%04x\r\n", usbd_msc_cfg.start_sector);
-
-    usbd_msc_cfg.nsectors = GET_BE32(&usbd_msc_cfg.cbw.CB[6]); /* Number of Blocks to transfer */
-    USB_LOG_DBG("nsectors: 0x%02x\r\n", usbd_msc_cfg.nsectors);
-
-    data_len = usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size;
-    if ((usbd_msc_cfg.start_sector + usbd_msc_cfg.nsectors) > usbd_msc_cfg.scsi_blk_nbr) {
-        USB_LOG_ERR("LBA out of range\r\n");
-        return false;
-    }
-
-    if (usbd_msc_cfg.cbw.dDataLength != data_len) {
-        return false;
+    if (read) {
+        usbd_msc_cfg.stage = MSC_DATA_IN;
+        return SCSI_processRead();
     }
     usbd_msc_cfg.stage = MSC_DATA_OUT;
     data_len = MIN(data_len, CONFIG_USBDEV_MSC_BLOCK_SIZE);
     usbd_ep_start_read(mass_ep_data[MSD_OUT_EP_IDX].ep_addr, usbd_msc_cfg.block_buffer, data_len);
     return true;
 }
+
 /* do not use verify to reduce code size */
 #if 0
 static bool SCSI_verify10(uint8_t **data, uint32_t *len)
@@ -660,13 +643,20 @@ static bool SCSI_processRead(void)
 }
 
 #ifdef CONFIG_USBDEV_MSC_THREAD
-static void usbd_msc_thread_memory_read_done(void)
+static void usbd_msc_thread_memory_read_done(int ret)
 {
     size_t flags;
     uint32_t transfer_len;
 
     flags = usb_osal_enter_critical_section();
 
+    if (ret != 0) {
+        SCSI_SetSenseData(SCSI_KCQHE_UREINRESERVEDAREA);
+        usbd_msc_send_csw(CSW_STATUS_CMD_FAILED);
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+
     transfer_len = MIN(usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size, CONFIG_USBDEV_MSC_BLOCK_SIZE);
 
     usbd_ep_start_write(mass_ep_data[MSD_IN_EP_IDX].ep_addr,
@@ -696,7 +686,7 @@ static bool SCSI_processWrite(uint32_t nbytes)
     return true;
 #else
     if (usbd_msc_sector_write(usbd_msc_cfg.start_sector, usbd_msc_cfg.block_buffer, nbytes) != 0) {
-        SCSI_SetSenseData(SCSI_KCQHE_WRITEFAULT);
+        SCSI_SetSenseData(SCSI_KCQME_WRITEFAULT);
         return false;
     }
 #endif
@@ -716,13 +706,21 @@ static bool SCSI_processWrite(uint32_t nbytes)
 }
 
 #ifdef CONFIG_USBDEV_MSC_THREAD
-static void usbd_msc_thread_memory_write_done()
+static void usbd_msc_thread_memory_write_done(int ret)
 {
     size_t flags;
     uint32_t data_len = 0;
 
     flags = usb_osal_enter_critical_section();
 
+    /* Fail the command as SCSI_processWrite() does in the IRQ path */
+    if (ret != 0) {
+        SCSI_SetSenseData(SCSI_KCQME_WRITEFAULT);
+        usbd_msc_send_csw(CSW_STATUS_CMD_FAILED);
+        usb_osal_leave_critical_section(flags);
+        return;
+    }
+
     usbd_msc_cfg.start_sector += (current_byte_read / usbd_msc_cfg.scsi_blk_size);
     usbd_msc_cfg.nsectors -= (current_byte_read / usbd_msc_cfg.scsi_blk_size);
     usbd_msc_cfg.csw.dDataResidue -= current_byte_read;
@@ -736,6 +734,22 @@ static void usbd_msc_thread_memory_write_done()
 
     usb_osal_leave_critical_section(flags);
 }
+
+static void usbd_msc_thread_command_done(int ret, uint32_t KCQ)
+{
+    size_t flags;
+
+    flags = usb_osal_enter_critical_section();
+
+    if (ret != 0) {
+        SCSI_SetSenseData(KCQ);
+        usbd_msc_send_csw(CSW_STATUS_CMD_FAILED);
+    } else {
+        usbd_msc_send_csw(CSW_STATUS_CMD_PASSED);
+    }
+
+    usb_osal_leave_critical_section(flags);
+}
 #endif
 
 static bool SCSI_CBWDecode(uint32_t nbytes)
@@ -787,16 +801,13 @@ static bool SCSI_CBWDecode(uint32_t nbytes)
                 ret = SCSI_readCapacity10(&buf2send, &len2send);
                 break;
             case SCSI_CMD_READ10:
-                ret = SCSI_read10(NULL, 0);
-                break;
             case SCSI_CMD_READ12:
-                ret = SCSI_read12(NULL, 0);
-                break;
             case SCSI_CMD_WRITE10:
-                ret = SCSI_write10(NULL, 0);
-                break;
             case SCSI_CMD_WRITE12:
-                ret = SCSI_write12(NULL, 0);
+                ret = SCSI_readWrite();
+                break;
+            case SCSI_CMD_SYNCHCACHE10:
+                ret = SCSI_synchronizeCache10(&buf2send, &len2send);
                 break;
             case SCSI_CMD_VERIFY10:
                 //ret = SCSI_verify10(NULL, 0);
@@ -819,6 +830,10 @@ static bool SCSI_CBWDecode(uint32_t nbytes)
                 usbd_msc_send_csw(CSW_STATUS_CMD_PASSED);
             }
         }
+    } else if (usbd_msc_cfg.cbw.dDataLength == 0U) {
+        /* No data phase to stall, the status alone tells the host */
+        usbd_msc_send_csw(CSW_STATUS_CMD_FAILED);
+        ret = true;
     }
     return ret;
 }
@@ -887,23 +902,28 @@ void mass_storage_bulk_in(uint8_t ep, uint32_t nbytes)
 static void usbd_msc_thread(void *argument)
 {
     uint32_t data_len = 0;
+    int ret;
     while (1) {
         usb_osal_sem_take(msc_sem, 0xffffffff);
 
         switch (thread_op) {
             case MSC_THREAD_OP_READ_MEM:
                 data_len = MIN(usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size, CONFIG_USBDEV_MSC_BLOCK_SIZE);
-                if (usbd_msc_sector_read(usbd_msc_cfg.start_sector, usbd_msc_cfg.block_buffer, data_len) != 0) {
-                    SCSI_SetSenseData(SCSI_KCQHE_UREINRESERVEDAREA);
-                }
-                usbd_msc_thread_memory_read_done();
+                ret = usbd_msc_sector_read(usbd_msc_cfg.start_sector, usbd_msc_cfg.block_buffer, data_len);
+                usbd_msc_thread_memory_read_done(ret);
                 break;
             case MSC_THREAD_OP_WRITE_MEM:
                 data_len = MIN(usbd_msc_cfg.nsectors * usbd_msc_cfg.scsi_blk_size, CONFIG_USBDEV_MSC_BLOCK_SIZE);
-                if (usbd_msc_sector_write(usbd_msc_cfg.start_sector, usbd_msc_cfg.block_buffer, data_len) != 0) {
-                    SCSI_SetSenseData(SCSI_KCQHE_WRITEFAULT);
-                }
-                usbd_msc_thread_memory_write_done();
+                ret = usbd_msc_sector_write(usbd_msc_cfg.start_sector, usbd_msc_cfg.block_buffer, data_len);
+                usbd_msc_thread_memory_write_done(ret);
+                break;
+            case MSC_THREAD_OP_SYNC_CACHE:
+                ret = usbd_msc_sync_cache(usbd_msc_cfg.cbw.bLUN);
+                usbd_msc_thread_command_done(ret, SCSI_KCQHE_WRITEFAULT);
+                break;
+            case MSC_THREAD_OP_EJECT:
+                ret = usbd_msc_eject(usbd_msc_cfg.cbw.bLUN);
+                usbd_msc_thread_command_done(ret, SCSI_KCQIR_MEDIUMREMOVALPREVENTED);
                 break;
             default:
                 break;
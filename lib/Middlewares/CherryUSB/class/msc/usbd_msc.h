@@ -20,6 +20,11 @@ struct usbd_interface *usbd_msc_init_intf(struct usbd_interface *intf,
 void usbd_msc_get_cap(uint8_t lun, uint32_t *block_num, uint16_t *block_size);
 int usbd_msc_sector_read(uint32_t sector, uint8_t *buffer, uint32_t length);
 int usbd_msc_sector_write(uint32_t sector, uint8_t *buffer, uint32_t length);
+int usbd_msc_sync_cache(uint8_t lun);
+/* Returns true once after the medium changed, which the next command then reports */
+bool usbd_msc_unit_attention(uint8_t lun);
+/* START STOP UNIT with LOEJ=1, START=0: non-zero if the medium cannot be ejected */
+int usbd_msc_eject(uint8_t lun);
 
 void usbd_msc_set_readonly(bool readonly);
 
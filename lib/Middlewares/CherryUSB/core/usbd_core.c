@@ -146,6 +146,7 @@ static bool usbd_get_descriptor(uint16_t type_index, uint8_t **data, uint32_t *l
     type = HI_BYTE(type_index);
     index = LO_BYTE(type_index);
 
+#ifndef CONFIG_USBDEV_MSC_ONLY
     if ((type == USB_DESCRIPTOR_TYPE_STRING) && (index == USB_OSDESC_STRING_DESC_INDEX)) {
         USB_LOG_INFO("read MS OS 2.0 descriptor string\r\n");
 
@@ -167,12 +168,13 @@ static bool usbd_get_descriptor(uint16_t type_index, uint8_t **data, uint32_t *l
         *data = bos_desc->string;
         *len = bos_desc->string_len;
         return true;
-    }
+    } else
+#endif
     /*
      * Invalid types of descriptors,
      * see USB Spec. Revision 2.0, 9.4.3 Get Descriptor
      */
-    else if ((type == USB_DESCRIPTOR_TYPE_INTERFACE) || (type == USB_DESCRIPTOR_TYPE_ENDPOINT) ||
+    if ((type == USB_DESCRIPTOR_TYPE_INTERFACE) || (type == USB_DESCRIPTOR_TYPE_ENDPOINT) ||
 #ifndef CONFIG_USB_HS
              (type > USB_DESCRIPTOR_TYPE_ENDPOINT)) {
 #else
@@ -280,6 +282,7 @@ static bool usbd_set_configuration(uint8_t config_index, uint8_t alt_setting)
     return found;
 }
 
+#ifndef CONFIG_USBDEV_MSC_ONLY
 /**
  * @brief set USB interface
  *
@@ -340,6 +343,7 @@ static bool usbd_set_interface(uint8_t iface, uint8_t alt_setting)
 
     return ret;
 }
+#endif
 
 /**
  * @brief handle a standard device request
@@ -452,6 +456,7 @@ static bool usbd_std_interface_req_handler(struct usb_setup_packet *setup,
             break;
 
         case USB_REQUEST_GET_DESCRIPTOR:
+#ifndef CONFIG_USBDEV_MSC_ONLY
             if (type == 0x21) { /* HID_DESCRIPTOR_TYPE_HID */
                 USB_LOG_INFO("read hid descriptor\r\n");
                 usb_slist_t *i;
@@ -482,6 +487,7 @@ static bool usbd_std_interface_req_handler(struct usb_setup_packet *setup,
                     }
                 }
             }
+#endif
             ret = false;
             break;
         case USB_REQUEST_CLEAR_FEATURE:
@@ -494,7 +500,9 @@ static bool usbd_std_interface_req_handler(struct usb_setup_packet *setup,
             break;
 
         case USB_REQUEST_SET_INTERFACE:
+#ifndef CONFIG_USBDEV_MSC_ONLY
             usbd_set_interface(setup->wIndex, setup->wValue);
+#endif
             *len = 0;
             break;
 
@@ -658,6 +666,7 @@ static int usbd_class_request_handler(struct usb_setup_packet *setup, uint8_t **
  */
 static int usbd_vendor_request_handler(struct usb_setup_packet *setup, uint8_t **data, uint32_t *len)
 {
+#ifndef CONFIG_USBDEV_MSC_ONLY
     if (msosv1_desc) {
         if (setup->bRequest == msosv1_desc->vendor_code) {
             switch (setup->wIndex) {
@@ -703,6 +712,7 @@ static int usbd_vendor_request_handler(struct usb_setup_packet *setup, uint8_t *
             return 0;
         }
     }
+#endif
 
     return -1;
 }
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2022, sakumisu
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef USB_OSAL_H
+#define USB_OSAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void *usb_osal_thread_t;
+typedef void *usb_osal_sem_t;
+typedef void (*usb_thread_entry_t)(void *argument);
+
+usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args);
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count);
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout);
+int usb_osal_sem_give(usb_osal_sem_t sem);
+
+size_t usb_osal_enter_critical_section(void);
+void usb_osal_leave_critical_section(size_t flag);
+
+/* Bare-metal backend: threads are cooperative and only run from here, which
+ * the main loop calls. Returns when the running thread blocks again.
+ */
+void usb_osal_run(void);
+
+#endif /* USB_OSAL_H */
@@ -0,0 +1,159 @@
+/*
+ * Bare-metal OSAL for Cortex-M0+: one cooperative thread, run from the main
+ * loop through usb_osal_run(). It gets its own stack and gives the CPU back
+ * when usb_osal_sem_take() would block, so class code written for an RTOS
+ * thread (e.g. CONFIG_USBDEV_MSC_THREAD) runs outside the USB interrupt.
+ *
+ * Semaphores may be given from interrupts. Only the thread may take them.
+ */
+#include "usb_config.h"
+#include "usb_osal.h"
+#include "usb_errno.h"
+#include "py32f0xx.h"
+
+#ifndef CONFIG_USB_OSAL_STACKSIZE
+#define CONFIG_USB_OSAL_STACKSIZE 1024
+#endif
+
+#ifndef CONFIG_USB_OSAL_MAX_SEMS
+#define CONFIG_USB_OSAL_MAX_SEMS 1
+#endif
+
+typedef struct
+{
+    volatile uint32_t count;
+} bm_sem_t;
+
+static struct
+{
+    uint32_t *sp;         // Saved stack pointer while not running
+    const bm_sem_t *wait; // Blocked on
+    usb_thread_entry_t entry;
+    void *args;
+} thread;
+
+static uint32_t *main_sp;
+static uint32_t thread_stack[CONFIG_USB_OSAL_STACKSIZE / 4] __attribute__((aligned(8)));
+
+static bm_sem_t sems[CONFIG_USB_OSAL_MAX_SEMS];
+static uint32_t sems_used = 0;
+
+// Saves the callee-saved registers and SP to *save_sp, then resumes the
+// context at new_sp. Exceptions keep stacking on whichever stack is current.
+__attribute__((naked, noinline)) static void switch_context(uint32_t **save_sp, uint32_t *new_sp)
+{
+    __asm volatile(
+        "push {r4-r7, lr}   \n"
+        "mov r4, r8         \n"
+        "mov r5, r9         \n"
+        "mov r6, r10        \n"
+        "mov r7, r11        \n"
+        "push {r4-r7}       \n"
+        "mov r2, sp         \n"
+        "str r2, [r0]       \n"
+        "mov sp, r1         \n"
+        "pop {r4-r7}        \n"
+        "mov r8, r4         \n"
+        "mov r9, r5         \n"
+        "mov r10, r6        \n"
+        "mov r11, r7        \n"
+        "pop {r4-r7, pc}    \n");
+}
+
+static void thread_start()
+{
+    thread.entry(thread.args);
+
+    // Not expected, but never return into nothing
+    while (1)
+    {
+        switch_context(&thread.sp, main_sp);
+    }
+}
+
+usb_osal_thread_t usb_osal_thread_create(const char *name, uint32_t stack_size, uint32_t prio, usb_thread_entry_t entry, void *args)
+{
+    if (thread.entry || stack_size > sizeof(thread_stack))
+    {
+        return NULL;
+    }
+
+    thread.entry = entry;
+    thread.args = args;
+
+    // Initial frame as popped by switch_context: r8-r11, r4-r7, pc
+    uint32_t *sp = thread_stack + sizeof(thread_stack) / 4 - 9;
+    for (int i = 0; i < 8; i++)
+    {
+        sp[i] = 0;
+    }
+    sp[8] = (uint32_t)thread_start;
+    thread.sp = sp;
+    return &thread;
+}
+
+usb_osal_sem_t usb_osal_sem_create(uint32_t initial_count)
+{
+    if (sems_used >= CONFIG_USB_OSAL_MAX_SEMS)
+    {
+        return NULL;
+    }
+    bm_sem_t *sem = &sems[sems_used++];
+    sem->count = initial_count;
+    return sem;
+}
+
+int usb_osal_sem_take(usb_osal_sem_t sem, uint32_t timeout)
+{
+    bm_sem_t *s = sem;
+    while (1)
+    {
+        size_t flags = usb_osal_enter_critical_section();
+        if (s->count)
+        {
+            s->count--;
+            usb_osal_leave_critical_section(flags);
+            return 0;
+        }
+        usb_osal_leave_critical_section(flags);
+
+        if (0 == timeout)
+        {
+            return -ETIMEDOUT;
+        }
+        // Any other timeout waits forever
+        thread.wait = s;
+        switch_context(&thread.sp, main_sp);
+    }
+}
+
+int usb_osal_sem_give(usb_osal_sem_t sem)
+{
+    bm_sem_t *s = sem;
+    size_t flags = usb_osal_enter_critical_section();
+    s->count++;
+    usb_osal_leave_critical_section(flags);
+    return 0;
+}
+
+size_t usb_osal_enter_critical_section(void)
+{
+    size_t flags = __get_PRIMASK();
+    __disable_irq();
+    return flags;
+}
+
+void usb_osal_leave_critical_section(size_t flag)
+{
+    __set_PRIMASK(flag);
+}
+
+void usb_osal_run(void)
+{
+    if (!thread.entry || (thread.wait && !thread.wait->count))
+    {
+        return;
+    }
+    thread.wait = NULL;
+    switch_context(&main_sp, thread.sp);
+}
@@ -60,6 +60,7 @@ struct pyusb_ep_state {
 struct pyusb_udc {
   volatile uint8_t dev_addr;
   volatile uint32_t fifo_size_offset;
+  volatile uint8_t out_ahead; /* OUT endpoints that may hold a packet accepted ahead of usbd_ep_start_read */
   __attribute__((aligned(32))) struct usb_setup_packet setup;
   struct pyusb_ep_state in_ep[USB_NUM_BIDIR_ENDPOINTS];  /*!< IN endpoint parameters*/
   struct pyusb_ep_state out_ep[USB_NUM_BIDIR_ENDPOINTS]; /*!< OUT endpoint parameters */
@@ -322,6 +323,12 @@ int usbd_ep_set_stall(const uint8_t ep)
     } else
     {
       USB->OUT_CSR1 |= USB_OUTCSR_SendStall;
+
+      /* Drop a packet accepted ahead: it belongs to the transfer being stalled */
+      if (USB->OUT_CSR1 & USB_OUTCSR_OPR)
+      {
+        USB->OUT_CSR1 |= USB_OUTCSR_FF;
+      }
     }
   } else
   {
@@ -359,6 +366,11 @@ int usbd_ep_clear_stall(const uint8_t ep)
       USB->OUT_CSR1 &= ~(USB_OUTCSR_SendStall | USB_OUTCSR_SentStall);
       /* Reset the data toggle. */
       USB->OUT_CSR1 |= USB_OUTCSR_CDT;
+      /* The host starts over, so drop what was accepted ahead */
+      if (USB->OUT_CSR1 & USB_OUTCSR_OPR)
+      {
+        USB->OUT_CSR1 |= USB_OUTCSR_FF;
+      }
     }
   } else
   {
@@ -561,11 +573,16 @@ int usbd_ep_start_read(const uint8_t ep, uint8_t *data, uint32_t data_len)
   }
   else
   {
-    /* Enable ep receive interrupt before clear OutPktRdy */
+    /* OutPktRdy was cleared when the last transfer ended, so the FIFO may
+       hold its first packet already. The interrupt for it came while
+       disabled and may have been dropped, so check from the ISR. */
     USB->INT_OUT1E |= (1 << ep_idx);
 
-    /* Clear OutPktRdy to receive data */
-    USB->OUT_CSR1 &= ~USB_OUTCSR_OPR;
+    if (USB->OUT_CSR1 & USB_OUTCSR_OPR)
+    {
+      g_pyusb_udc.out_ahead |= (1 << ep_idx);
+      NVIC_SetPendingIRQ(USBD_IRQn);
+    }
   }
 
   pyusb_set_active_ep(old_ep_idx);
@@ -657,7 +674,8 @@ static void handle_ep0(void)
   }
 }
 
-void USBD_IRQHandler(void)
+/* Stays in flash, out of the RAM USB_IRQHandler() that calls it */
+__attribute__((noinline)) void USBD_IRQHandler(void)
 {
   uint32_t is;
   uint32_t txis;
@@ -668,7 +686,8 @@ void USBD_IRQHandler(void)
 
   is   = USB->INT_USB;
   txis = USB->INT_IN1;
-  rxis = USB->INT_OUT1;
+  rxis = USB->INT_OUT1 | g_pyusb_udc.out_ahead;
+  g_pyusb_udc.out_ahead = 0;
 
   old_ep_idx = pyusb_get_active_ep();
 
@@ -764,13 +783,15 @@ void USBD_IRQHandler(void)
         g_pyusb_udc.out_ep[ep_idx].actual_xfer_len += read_count;
         g_pyusb_udc.out_ep[ep_idx].xfer_len -= read_count;
 
+        /* Free the FIFO either way: at the end of a transfer, the next
+           packet comes in while the class handles this one, and waits for
+           usbd_ep_start_read */
+        USB->OUT_CSR1 &= ~USB_OUTCSR_OPR;
+
         if ((read_count < g_pyusb_udc.out_ep[ep_idx].ep_mps) || (g_pyusb_udc.out_ep[ep_idx].xfer_len == 0))
         {
           USB->INT_OUT1E &=  ~(1 << ep_idx);
           usbd_event_ep_out_complete_handler(ep_idx, g_pyusb_udc.out_ep[ep_idx].actual_xfer_len);
-        } else
-        {
-          USB->OUT_CSR1 &= ~USB_OUTCSR_OPR;
         }
       }
 
@@ -44,13 +44,7 @@ void board_init()
     InitStruct.OutputType = LL_GPIO_OUTPUT_PUSHPULL;
     InitStruct.Pull = LL_GPIO_PULL_UP;
 
-    // Input ----------
-
-    InitStruct.Mode = LL_GPIO_MODE_INPUT;
-
-    // PTT & keypad rows
-    InitStruct.Pin = PTT_PIN | KEYPAD_ROW1_PIN | KEYPAD_ROW2_PIN;
-    LL_GPIO_Init(GPIOB, &InitStruct);
+    // Input: PTT & keypad rows, see board_init_keys()
 
     // Output -----
 
@@ -85,6 +79,21 @@ void board_init()
 
 // Keypad ------
 
+void board_init_keys()
+{
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOB);
+
+    // Runs from fw_boot_early(), before the startup code copies .ramfunc
+    LL_GPIO_InitTypeDef InitStruct;
+    InitStruct.Pin = PTT_PIN | KEYPAD_ROW1_PIN | KEYPAD_ROW2_PIN;
+    InitStruct.Mode = LL_GPIO_MODE_INPUT;
+    InitStruct.Speed = LL_GPIO_SPEED_FREQ_HIGH;
+    InitStruct.OutputType = LL_GPIO_OUTPUT_PUSHPULL;
+    InitStruct.Pull = LL_GPIO_PULL_UP;
+    InitStruct.Alternate = LL_GPIO_AF_0;
+    LL_GPIO_Init(GPIOB, &InitStruct);
+}
+
 bool board_check_PTT()
 {
     return !LL_GPIO_IsInputPinSet(PTT_GPIOx, PTT_PIN);
@@ -92,7 +101,6 @@ bool board_check_PTT()
 
 bool board_check_side_keys()
 {
-    LL_mDelay(3);
     return !LL_GPIO_IsInputPinSet(KEYPAD_ROW1_GPIOx, KEYPAD_ROW1_PIN) //
            || !LL_GPIO_IsInputPinSet(KEYPAD_ROW2_GPIOx, KEYPAD_ROW2_PIN);
 }
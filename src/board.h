@@ -9,9 +9,12 @@
 
 void board_init();
 
+// PTT and the keypad rows only, as inputs pulled up, which want some time to
+// settle before they are read. Safe ahead of the C runtime set-up, see
+// fw_boot_early().
+void board_init_keys();
 bool board_check_PTT();
 bool board_check_side_keys();
-bool board_check_M_key();
 
 void board_backlight_on(uint32_t delay);
 void board_backlight_off();
@@ -0,0 +1,16 @@
+#include "crc.h"
+#include "py32f071_ll_bus.h"
+#include "py32f071_ll_crc.h"
+
+uint32_t crc_compute_buf(const void *buf, uint32_t size)
+{
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_CRC);
+    LL_CRC_ResetCRCCalculationUnit(CRC);
+
+    const uint32_t *p = buf;
+    for (uint32_t i = 0; i < size / 4; i++)
+    {
+        LL_CRC_FeedData32(CRC, p[i]);
+    }
+    return LL_CRC_ReadData32(CRC);
+}
@@ -0,0 +1,16 @@
+#ifndef _CRC_H
+#define _CRC_H
+
+#include <stdint.h>
+
+// CRC-32/MPEG-2 (poly 0x04C11DB7, init 0xFFFFFFFF, not reflected, no final
+// XOR) over the little-endian words at addr, as the CRC unit computes it.
+// size is a multiple of 4.
+uint32_t crc_compute_buf(const void *buf, uint32_t size);
+
+static inline uint32_t crc_compute(uint32_t addr, uint32_t size)
+{
+    return crc_compute_buf((const void *)addr, size);
+}
+
+#endif // _CRC_H
@@ -10,6 +10,7 @@
 #include "uf2.h"
 #include "fw.h"
 #include "internal_flash.h"
+#include "dfu_write.h"
 
 #define _VOLUME_CREATE_DATE FAT_MK_DATE(2025, 11, 1)
 #define _VOLUME_CREATE_TIME FAT_MK_TIME(9, 0, 0)
@@ -186,11 +187,127 @@ static void on_sector_read_FAT(uint32_t sector, uint8_t *buf, uint32_t entry_fir
     } // for
 }
 
+// Metadata shadow ---------------
+//
+// FAT and root directory sectors the host wrote read back as written, so the
+// host finds the volume as it left it (macOS and Windows put their own files
+// and the dirty bit there). Only the most recently used ones are kept; the
+// rest read as generated again.
+
+#if defined(ENABLE_SHADOW)
+static struct
+{
+    bool valid;
+    uint32_t sector;
+    uint32_t used; // Stamp of the last access, 0 if free
+    uint8_t data[SECTOR_SIZE];
+} shadow[DFU_SHADOW_SECTORS] = {0};
+
+static uint32_t shadow_stamp = 0;
+
+static inline bool shadow_sector(uint32_t sector)
+{
+    return sector >= FAT_SECTOR && sector < DATA_SECTOR;
+}
+
+static bool shadow_read(uint32_t sector, uint8_t *buf)
+{
+    if (!shadow_sector(sector))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < DFU_SHADOW_SECTORS; i++)
+    {
+        if (shadow[i].valid && sector == shadow[i].sector)
+        {
+            shadow[i].used = ++shadow_stamp;
+            memcpy(buf, shadow[i].data, SECTOR_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
+
+void dfu_shadow_write(uint32_t sector, const uint8_t *buf)
+{
+    if (!shadow_sector(sector))
+    {
+        return;
+    }
+
+    // The same sector, or else a free or the least recently used one
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < DFU_SHADOW_SECTORS; i++)
+    {
+        if (shadow[i].valid && sector == shadow[i].sector)
+        {
+            slot = i;
+            break;
+        }
+        if (shadow[i].used < shadow[slot].used)
+        {
+            slot = i;
+        }
+    }
+    shadow[slot].valid = true;
+    shadow[slot].sector = sector;
+    shadow[slot].used = ++shadow_stamp;
+    memcpy(shadow[slot].data, buf, SECTOR_SIZE);
+}
+
+static void shadow_clear()
+{
+    memset(shadow, 0, sizeof(shadow));
+}
+#else
+static inline bool shadow_read(uint32_t sector, uint8_t *buf)
+{
+    return false;
+}
+
+static inline void shadow_clear()
+{
+}
+#endif
+
+// Medium change ---------------
+
+static volatile bool medium_changed = false;
+
+void dfu_medium_changed()
+{
+    // What the host wrote names the file it copied, not the firmware now
+    shadow_clear();
+    medium_changed = true;
+}
+
+bool usb_fs_medium_changed()
+{
+    if (!medium_changed)
+    {
+        return false;
+    }
+    medium_changed = false;
+    return true;
+}
+
 // ---------------
 
+static volatile bool configured = false;
+
+// The backlight goes on from the main loop, see dfu_process()
 void usb_fs_configure_done()
 {
-    board_backlight_on(BOARD_DEFAULT_BACKLIGHT_DELAY);
+    configured = true;
+}
+
+void dfu_process()
+{
+    if (configured)
+    {
+        configured = false;
+        board_backlight_on(BOARD_DEFAULT_BACKLIGHT_DELAY);
+    }
 }
 
 void usb_fs_get_cap(uint32_t *sector_num, uint16_t *sector_size)
@@ -215,6 +332,11 @@ int usb_fs_sector_read(uint32_t sector, uint8_t *buf, uint32_t size)
         return 1;
     }
 
+    if (shadow_read(sector, buf))
+    {
+        return 0;
+    }
+
     memset(buf, 0, SECTOR_SIZE);
 
     if (BOOT_SECTOR == sector)
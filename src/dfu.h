@@ -39,4 +39,29 @@
 #define INDEX_HTM_SECTOR 2   // First data sector of INDEX.HTM
 #define CURRENT_UF2_SECTOR 3 // First data sector of CURRENT.UF2
 
+// Metadata shadow -----
+
+#if defined(ENABLE_SHADOW)
+// FAT and root directory sectors the host wrote, kept in RAM to read back
+#ifndef DFU_SHADOW_SECTORS
+#define DFU_SHADOW_SECTORS 4
+#endif
+
+// Keeps buf if sector is a FAT or root directory one
+void dfu_shadow_write(uint32_t sector, const uint8_t *buf);
+#else
+static inline void dfu_shadow_write(uint32_t sector, const uint8_t *buf)
+{
+}
+#endif
+
+// Medium change -----
+
+// The volume reads as generated again, CURRENT.UF2 with the firmware now in
+// flash, and the host is told to re-read it (SCSI unit attention)
+void dfu_medium_changed();
+
+// Main loop work of dfu.c, called by usb_fs_process()
+void dfu_process();
+
 #endif // _DFU_H
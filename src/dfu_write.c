@@ -1,13 +1,24 @@
 #include "usb_fs.h"
 #include "dfu.h"
+#include "dfu_write.h"
+#include "dfu_write_priv.h"
 #include "internal_flash.h"
 #include "uf2.h"
 #include <string.h>
 #include "board.h"
+#include "lcd.h"
 #include "main.h"
 #include "log.h"
 
-#define PAGE_SIZE 256
+// Page buffer: block payloads are assembled into whole pages, which are
+// programmed from the main loop once complete. A payload may straddle pages
+// (e.g. 476-byte blocks), so a page can take more than one block to fill.
+// When all slots are in use, the next block waits for one to get programmed,
+// and the OUT endpoint NAKs meanwhile. Two slots let the next page come in
+// while one is being programmed.
+#ifndef DFU_WRITE_CACHE_SLOTS
+#define DFU_WRITE_CACHE_SLOTS 2
+#endif
 
 enum
 {
@@ -16,17 +27,54 @@ enum
     REJECT_BLOCK,
 };
 
+static_assert(FLASH_SECTOR_NB <= 32);
+
+program_state_t program_state = {0};
+
+static uint32_t block_map[(MAX_BLOCKS + 31) / 32] = {0}; // Bit map of blocks received
+
+dfu_write_stats_t write_stats = {0};
+
+// Side blocks carry no data but a record for the image: verify blocks. They
+// count in num_blocks, so every build takes them, checking the record only
+// with ENABLE_UF2_VERIFY. An image has one at most (see MAX_BLOCKS). It may
+// come ahead of the image, as the host picks the order, and is then counted
+// once it starts, if it is its.
 static struct
 {
-    // uint32_t base_addr;
-    // uint32_t num_pages;
-    uint32_t num_blocks;
-    uint8_t in_progress;
-} program_state = {0};
+    uint32_t num_blocks; // Of the image the side block ahead of it is for, 0 if none
+    uint32_t block_no;
+} early = {0};
 
-static uint8_t block_map[FW_PAGE_NUM] = {0};
+static dfu_verify_t verify = {0};
+
+enum
+{
+    SLOT_FREE,
+    SLOT_OPEN,  // Being filled
+    SLOT_READY, // Every word received
+};
 
-static uint8_t page_buf[PAGE_SIZE];
+typedef struct
+{
+    uint32_t page_addr;
+    uint32_t filled[PAGE_WORDS / 32]; // Bit map of words received
+    union
+    {
+        uint8_t data[PAGE_SIZE];
+        uint32_t words[PAGE_WORDS];
+    };
+    uint8_t state;
+} page_slot_t;
+
+static page_slot_t page_slots[DFU_WRITE_CACHE_SLOTS] = {0};
+
+static_assert(PAGE_WORDS == 64);
+
+static inline bool block_no_valid(const uf2_block_t *block)
+{
+    return block->num_blocks <= MAX_BLOCKS && block->block_no < block->num_blocks;
+}
 
 static uint32_t check_block(const uf2_block_t *block)
 {
@@ -34,70 +82,456 @@ static uint32_t check_block(const uf2_block_t *block)
     {
         return IGNORE_BLOCK;
     }
-    if (UF2_FLAG_NOFLASH & block->flags)
+#if defined(ENABLE_STAY_IN_DFU)
+    if (UF2_FLAG_MOTO_RESET & block->flags)
+    {
+        return ACCEPT_BLOCK; // Command only
+    }
+#endif
+    if (UF2_FLAG_MOTO_LZSS & block->flags)
+    {
+        if (!lzss_block_valid(block))
+        {
+            return REJECT_BLOCK;
+        }
+    }
+    else if (UF2_FLAG_MOTO_FILL & block->flags)
+    {
+        if (!fill_block_valid(block))
+        {
+            return REJECT_BLOCK;
+        }
+    }
+    else if (UF2_FLAG_MOTO_VERIFY & block->flags)
+    {
+        if (!verify_block_valid(block))
+        {
+            return REJECT_BLOCK;
+        }
+    }
+    else if (UF2_FLAG_NOFLASH & block->flags)
     {
         return IGNORE_BLOCK;
     }
 
-    // Allow less than one page
     if (0 == block->payload_size)
     {
         return IGNORE_BLOCK;
     }
-    else if (block->payload_size > FLASH_PAGE_SIZE)
+    else if (block->payload_size > UF2_MAX_PAYLOAD_SIZE)
     {
         return REJECT_BLOCK;
     }
 
-    if (0 != block->target_addr % FLASH_PAGE_SIZE)
+    // Payloads may start anywhere in a page, but on a word
+    if (0 != block->target_addr % 4)
     {
         return REJECT_BLOCK;
     }
 
-    if (block->num_blocks > FW_PAGE_NUM)
+    return block_no_valid(block) ? ACCEPT_BLOCK : REJECT_BLOCK;
+}
+
+// Returns the data to write at target_addr and its size, or NULL if the
+// block does not decode. Fill blocks are only sized here, their data is made
+// as they apply.
+static const uint8_t *block_payload(const uf2_block_t *block, uint32_t *size)
+{
+    if (UF2_FLAG_MOTO_FILL & block->flags)
     {
-        return REJECT_BLOCK;
+        *size = ((const uf2_fill_t *)block->data)->size;
+        return block->data;
     }
-
-    if (block->block_no >= block->num_blocks)
+    if (UF2_FLAG_MOTO_LZSS & block->flags)
     {
-        return REJECT_BLOCK;
+        return lzss_block_payload(block, size);
     }
-
-    return ACCEPT_BLOCK;
+    *size = block->payload_size;
+    return block->data;
 }
 
-static bool accept_first_block(const uf2_block_t *block)
+static inline bool block_in_fw(const uf2_block_t *block, uint32_t size)
 {
-    const uint32_t target_addr = block->target_addr;
+    return FW_ADDR <= block->target_addr && block->target_addr < (FW_ADDR + FW_SIZE) //
+           && size <= FW_ADDR + FW_SIZE - block->target_addr;
+}
 
-    if (FW_ADDR <= target_addr && target_addr < FW_ADDR + FW_SIZE)
+static bool accept_first_block(const uf2_block_t *block, uint32_t size)
+{
+    if (block_in_fw(block, size))
     {
-        // program_state.base_addr = FW_ADDR;
         // program_state.num_pages = FW_PAGE_NUM;
-        program_state.num_blocks = block->num_blocks;
+        if (UF2_FLAG_MOTO_FILL & block->flags)
+        {
+            size /= fill_block_count(block); // That of the blocks it stands for
+        }
+        program_state.block_size = size;
+        program_state.visited_sectors = 0;
+        program_state.data_end = 0;
+
+        if (UF2_FLAG_MOTO_LZSS & block->flags)
+        {
+            lzss_block_start(block, size);
+            return true;
+        }
+
+        erase_start(block, size);
         return true;
     }
 
     return false;
 }
 
-static inline bool accept_subsequent_block(const uf2_block_t *block)
+static inline bool accept_subsequent_block(const uf2_block_t *block, uint32_t size)
+{
+    return block_in_fw(block, size);
+}
+
+static inline bool word_filled(const page_slot_t *slot, uint32_t w)
+{
+    return slot->filled[w / 32] & (1U << (w % 32));
+}
+
+static void flash_slot(page_slot_t *slot)
+{
+    log("program: %08x\n", slot->page_addr);
+
+    // Words the image leaves out keep what is in flash
+    const uint32_t *const base = (const uint32_t *)slot->page_addr;
+    for (uint32_t w = 0; w < PAGE_WORDS; w++)
+    {
+        if (!word_filled(slot, w))
+        {
+            slot->words[w] = base[w];
+        }
+    }
+    erase_ahead(slot->page_addr, true); // No-op if done ahead already
+    if (internal_flash_program_page(slot->page_addr, slot->data))
+    {
+        write_stats.bytes_programmed += PAGE_SIZE;
+    }
+    else
+    {
+        write_stats.bytes_skipped += PAGE_SIZE;
+    }
+    if (SLOT_READY == slot->state)
+    {
+        journal_mark(slot->page_addr);
+    }
+    erase_ahead(slot->page_addr + PAGE_SIZE, false);
+
+    slot->state = SLOT_FREE;
+}
+
+// Lowest page in the buffer, among the ready ones only or all
+static page_slot_t *lowest_slot(bool ready_only)
+{
+    page_slot_t *res = NULL;
+    for (uint32_t i = 0; i < DFU_WRITE_CACHE_SLOTS; i++)
+    {
+        page_slot_t *const slot = &page_slots[i];
+        if (SLOT_FREE == slot->state || (ready_only && SLOT_READY != slot->state))
+        {
+            continue;
+        }
+        if (!res || slot->page_addr < res->page_addr)
+        {
+            res = slot;
+        }
+    }
+    return res;
+}
+
+static page_slot_t *get_slot(uint32_t page_addr)
+{
+    page_slot_t *free_slot = NULL;
+    for (uint32_t i = 0; i < DFU_WRITE_CACHE_SLOTS; i++)
+    {
+        page_slot_t *const slot = &page_slots[i];
+        if (SLOT_FREE == slot->state)
+        {
+            if (!free_slot)
+            {
+                free_slot = slot;
+            }
+        }
+        else if (page_addr == slot->page_addr)
+        {
+            return slot;
+        }
+    }
+
+    if (!free_slot)
+    {
+        // Program a complete page, or else the lowest open one as far as it
+        // got. If the rest of it comes later, the page is programmed again.
+        free_slot = lowest_slot(true);
+        if (!free_slot)
+        {
+            free_slot = lowest_slot(false);
+        }
+        flash_slot(free_slot);
+    }
+
+    free_slot->page_addr = page_addr;
+    memset(free_slot->filled, 0, sizeof(free_slot->filled));
+    free_slot->state = SLOT_OPEN;
+    return free_slot;
+}
+
+static void fill_words(page_slot_t *slot, uint32_t offset, uint32_t end)
 {
-    return FW_ADDR <= block->target_addr && block->target_addr < (FW_ADDR + FW_SIZE);
+    for (uint32_t w = offset / 4; w < (end + 3) / 4; w++)
+    {
+        slot->filled[w / 32] |= 1U << (w % 32);
+    }
+    if (slot->filled[0] == 0xffffffff && slot->filled[1] == 0xffffffff)
+    {
+        slot->state = SLOT_READY;
+    }
 }
 
-static bool program_finished()
+void buffer_payload(uint32_t addr, const uint8_t *data, uint32_t size)
 {
-    for (uint32_t i = 0; i < program_state.num_blocks; i++)
+    data_received(addr, size);
+    while (size)
     {
-        if (!block_map[i])
+        const uint32_t offset = addr % PAGE_SIZE;
+        const uint32_t n = size < PAGE_SIZE - offset ? size : PAGE_SIZE - offset;
+        const uint32_t end = offset + n;
+        page_slot_t *const slot = get_slot(addr - offset);
+
+        // Bytes of the last word the payload leaves out stay as in flash,
+        // unless an earlier payload wrote them. Payloads start on a word, see
+        // check_block().
+        if (end % 4 && !word_filled(slot, end / 4))
+        {
+            memcpy(slot->data + end, (const uint8_t *)(addr - offset + end), 4 - end % 4);
+        }
+        memcpy(slot->data + offset, data, n);
+        fill_words(slot, offset, end);
+
+        addr += n;
+        data += n;
+        size -= n;
+    }
+}
+
+void buffer_fill(uint32_t addr, uint8_t value, uint32_t size)
+{
+    const uint32_t offset = addr % PAGE_SIZE;
+    page_slot_t *const slot = get_slot(addr - offset);
+    memset(slot->data + offset, value, size);
+    fill_words(slot, offset, offset + size);
+}
+
+bool buffer_has_page(uint32_t page_addr)
+{
+    for (uint32_t i = 0; i < DFU_WRITE_CACHE_SLOTS; i++)
+    {
+        if (SLOT_FREE != page_slots[i].state && page_addr == page_slots[i].page_addr)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool buffer_page_differs(uint32_t page_addr)
+{
+    for (uint32_t i = 0; i < DFU_WRITE_CACHE_SLOTS; i++)
+    {
+        const page_slot_t *const slot = &page_slots[i];
+        if (SLOT_FREE == slot->state || page_addr != slot->page_addr)
+        {
+            continue;
+        }
+        for (uint32_t w = 0; w < PAGE_WORDS; w++)
         {
-            return false;
+            if (word_filled(slot, w) && slot->words[w] != ((const uint32_t *)page_addr)[w])
+            {
+                return true;
+            }
         }
     }
+    return false;
+}
+
+static void apply_block(const uf2_block_t *block, const uint8_t *data, uint32_t size)
+{
+    if (UF2_FLAG_MOTO_FILL & block->flags)
+    {
+        fill_apply(block, size);
+    }
+    else if (journal_covers(block->target_addr, size))
+    {
+        write_stats.blocks_resumed++;
+    }
+    else
+    {
+        buffer_payload(block->target_addr, data, size);
+    }
+}
+
+static void flush_cache(bool ready_only)
+{
+    page_slot_t *slot;
+    while (NULL != (slot = lowest_slot(ready_only)))
+    {
+        flash_slot(slot);
+    }
+    internal_flash_wait();
+}
+
+bool block_received(uint32_t block_no)
+{
+    return block_map[block_no / 32] & (1U << (block_no % 32));
+}
+
+void mark_block(uint32_t block_no)
+{
+    block_map[block_no / 32] |= 1U << (block_no % 32);
+    write_stats.blocks_received++;
+    if (write_stats.blocks_received > 1 && block_no != program_state.last_block_no + 1)
+    {
+        write_stats.out_of_order++;
+    }
+    program_state.last_block_no = block_no;
+}
+
+static inline bool program_finished()
+{
+    return write_stats.blocks_received >= write_stats.num_blocks;
+}
+
+void dfu_write_get_stats(dfu_write_stats_t *res)
+{
+    *res = write_stats;
+}
+
+void dfu_write_get_verify(dfu_verify_t *res)
+{
+    *res = verify;
+}
+
+// first_block identifies the image for the flashing journal
+static void start_program(uint32_t num_blocks, const uf2_block_t *first_block)
+{
+    log("program start: %d\n", num_blocks);
+    program_state.in_progress = true;
+    memset(block_map, 0, sizeof(block_map));
+    memset(&write_stats, 0, sizeof(write_stats));
+    write_stats.num_blocks = num_blocks;
+    verify.result = DFU_VERIFY_NONE;
+    journal_start(first_block);
+    board_backlight_flash(50);
+#if defined(ENABLE_STAY_IN_DFU)
+    lcd_display_logo(); // Without the result of the image before
+#endif
+}
+
+// Boots the image just written. Builds with ENABLE_STAY_IN_DFU keep the
+// device in DFU mode for the next one instead, until the host asks for the
+// reset (see usb_fs_eject() and reset blocks).
+static void program_done()
+{
+#if defined(ENABLE_STAY_IN_DFU)
+    lcd_display_verify(true);
+#else
+    main_schedule_reset(500);
+#endif
+}
+
+static void finish_program()
+{
+    // Incl. pages the image only covers in part
+    flush_cache(false);
+    program_state.in_progress = false;
+    journal_clear();
+    log("program finished\n");
+    board_backlight_on(BOARD_DEFAULT_BACKLIGHT_DELAY);
+#if defined(ENABLE_STAY_IN_DFU)
+    // Hosts cache what they read of the volume, CURRENT.UF2 included
+    dfu_medium_changed();
+#endif
+
+    verify.result = verify_check(&verify);
+    if (DFU_VERIFY_NONE == verify.result)
+    {
+        program_done();
+        return;
+    }
+
+    lcd_display_verify(DFU_VERIFY_PASS == verify.result);
+    // Stay in DFU mode on failure, so the image can be written again
+    if (DFU_VERIFY_PASS == verify.result)
+    {
+        program_done();
+    }
+}
+
+#if defined(ENABLE_STAY_IN_DFU)
+// Other builds leave DFU mode once an image is written anyway, so they ignore
+// reset blocks like any NOFLASH one
+static int accept_reset_block()
+{
+    if (program_state.in_progress)
+    {
+        log("reset refused\n");
+        return 1;
+    }
+    main_schedule_reset(500);
+    return 0;
+}
+#endif
+
+static inline bool side_block(const uf2_block_t *block)
+{
+    return UF2_FLAG_MOTO_VERIFY & block->flags;
+}
+
+static int accept_side_block(const uf2_block_t *block)
+{
+    if (!program_state.in_progress)
+    {
+        early.num_blocks = block->num_blocks;
+        early.block_no = block->block_no;
+        verify_keep(block);
+        return 0;
+    }
 
-    return true;
+    if (block->num_blocks != write_stats.num_blocks)
+    {
+        log("side block rejected\n");
+        return 1;
+    }
+    if (block_received(block->block_no))
+    {
+        write_stats.duplicates++;
+        return 0;
+    }
+    verify_keep(block);
+    mark_block(block->block_no);
+    if (program_finished())
+    {
+        finish_program();
+    }
+    return 0;
+}
+
+// Counts the side block that came ahead of the image just started, if it is
+// its
+static void start_side_blocks(const uf2_block_t *first_block)
+{
+    if (first_block->num_blocks == early.num_blocks && first_block->block_no != early.block_no)
+    {
+        mark_block(early.block_no);
+    }
+    else
+    {
+        verify_clear();
+    }
+    early.num_blocks = 0;
 }
 
 int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
@@ -113,6 +547,8 @@ int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
         return 1;
     }
 
+    dfu_shadow_write(sector, buf);
+
     // UF2 block
     do
     {
@@ -128,15 +564,31 @@ int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
         {
             return 1; // Raise error
         }
+#if defined(ENABLE_STAY_IN_DFU)
+        if (UF2_FLAG_MOTO_RESET & block->flags)
+        {
+            return accept_reset_block();
+        }
+#endif
+        if (side_block(block))
+        {
+            return accept_side_block(block);
+        }
+
+        uint32_t size;
+        const uint8_t *const data = block_payload(block, &size);
+        if (!data)
+        {
+            log("block not decoded\n");
+            return 1;
+        }
 
         if (!program_state.in_progress)
         {
-            if (accept_first_block(block))
+            if (accept_first_block(block, size))
             {
-                log("program start: %d\n", block->num_blocks);
-                program_state.in_progress = true;
-                memset(block_map, 0, block->num_blocks);
-                board_backlight_flash(50);
+                start_program(block->num_blocks, block);
+                start_side_blocks(block);
             }
             else
             {
@@ -146,11 +598,12 @@ int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
         }
         else
         {
-            if (accept_subsequent_block(block))
+            if (accept_subsequent_block(block, size))
             {
-                if (block_map[block->block_no])
+                if (block_received(block->block_no))
                 {
                     // Repeat
+                    write_stats.duplicates++;
                     return 0;
                 }
             }
@@ -161,27 +614,25 @@ int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
             }
         }
 
-        log("program: %d, %08x\n", block->block_no, block->target_addr);
-        if (block->payload_size < PAGE_SIZE)
-        {
-            memcpy(page_buf, block->data, block->payload_size);
-            memcpy(page_buf + block->payload_size, (void *)(block->target_addr + block->payload_size), PAGE_SIZE - block->payload_size);
-            internal_flash_program_page(block->target_addr, page_buf);
-        }
-        else
+        erase_track(block, size);
+
+        apply_block(block, data, size);
+        mark_block(block->block_no);
+        if (UF2_FLAG_MOTO_FILL & block->flags)
         {
-            internal_flash_program_page(block->target_addr, block->data);
+            // Counts as the blocks it stands for
+            for (uint32_t i = 1; i < fill_block_count(block); i++)
+            {
+                if (!block_received(block->block_no + i))
+                {
+                    mark_block(block->block_no + i);
+                }
+            }
         }
-        block_map[block->block_no] = true;
 
         if (program_finished())
         {
-            log("program finished\n");
-            board_backlight_on(BOARD_DEFAULT_BACKLIGHT_DELAY);
-
-            main_schedule_reset(500);
-
-            program_state.in_progress = false;
+            finish_program();
         }
 
         return 0;
@@ -190,3 +641,38 @@ int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size)
 
     return 0;
 }
+
+// Programs every page with data, the ones still being filled as far as they
+// got (see flash_slot()): the host may be about to detach. If the blocks
+// completing them follow after all, they get programmed again.
+int usb_fs_sync()
+{
+    flush_cache(false);
+    return 0;
+}
+
+// Leaves DFU mode like a reset block, in builds with ENABLE_STAY_IN_DFU.
+// Otherwise the device resets once an image is written anyway.
+int usb_fs_eject()
+{
+#if defined(ENABLE_STAY_IN_DFU)
+    return accept_reset_block();
+#else
+    return 0;
+#endif
+}
+
+void usb_fs_process()
+{
+    dfu_process();
+
+    if (internal_flash_is_busy())
+    {
+        return;
+    }
+    page_slot_t *const slot = lowest_slot(true);
+    if (slot)
+    {
+        flash_slot(slot);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _DFU_WRITE_H
+#define _DFU_WRITE_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t num_blocks;       // Of the image being written, or the last one
+    uint32_t blocks_received;  // Distinct blocks accepted
+    uint32_t duplicates;       // Blocks received again
+    uint32_t out_of_order;     // Blocks not right after the previous one
+    uint32_t bytes_programmed; // Whole pages
+    uint32_t bytes_skipped;    // Pages that held the data already
+    uint32_t blocks_resumed;   // Skipped as the flashing journal has them programmed
+} dfu_write_stats_t;
+
+// Progress of the image being written, kept until the next one starts
+void dfu_write_get_stats(dfu_write_stats_t *stats);
+
+enum
+{
+    DFU_VERIFY_NONE, // No image written, or it came without a verify block
+    DFU_VERIFY_PASS,
+    DFU_VERIFY_FAIL,
+};
+
+typedef struct
+{
+    uint8_t result;
+    uint32_t image_addr;
+    uint32_t image_size;
+    uint32_t expected_crc; // From the verify block
+    uint32_t actual_crc;   // Of the flash as written
+} dfu_verify_t;
+
+// Result of checking the last image against its verify block
+void dfu_write_get_verify(dfu_verify_t *verify);
+
+#endif // _DFU_WRITE_H
@@ -0,0 +1,97 @@
+#include "dfu_write_priv.h"
+#include "internal_flash.h"
+#include "log.h"
+
+// Erase ahead: a linear image covers [base_addr, image_end) with no holes, so
+// every sector inside that range is going to be rewritten and can be erased
+// in one go before the first page lands in it, if that page changes. Sectors
+// whose first page the image leaves as it is are likely the same throughout,
+// e.g. when writing the firmware again, so they are erased page by page like
+// all others, incl. sector 1 which it shares with the bootloader. That keeps
+// unchanged pages from being erased at all.
+
+// Plain blocks are all the same size but the last, compressed ones carry the
+// image extent instead
+static bool block_linear(const uf2_block_t *block, uint32_t size)
+{
+    if (UF2_FLAG_MOTO_LZSS & block->flags)
+    {
+        return lzss_block_linear(block, size);
+    }
+    return block->target_addr == program_state.base_addr + block->block_no * program_state.block_size;
+}
+
+void erase_start(const uf2_block_t *block, uint32_t size)
+{
+    const uint32_t offset = block->block_no * size;
+    program_state.base_addr = block->target_addr - offset;
+    program_state.image_end = program_state.base_addr + block->num_blocks * size;
+    if (program_state.image_end > FW_ADDR + FW_SIZE)
+    {
+        // Side blocks count too, numbered after the data, so a whole image
+        // ends past the firmware by them
+        program_state.image_end = FW_ADDR + FW_SIZE;
+    }
+    program_state.linear = offset <= block->target_addr - FW_ADDR;
+}
+
+void erase_track(const uf2_block_t *block, uint32_t size)
+{
+    if (program_state.linear && !block_linear(block, size))
+    {
+        program_state.linear = false;
+    }
+}
+
+void data_received(uint32_t addr, uint32_t size)
+{
+    if (addr + size > program_state.data_end)
+    {
+        program_state.data_end = addr + size;
+    }
+}
+
+// Also called for the page after the one just programmed, so the erase runs
+// while that page is still coming in over USB, if what came in of it already
+// differs from flash. Sectors are only ever erased on the first visit that
+// decides, before anything got programmed into them.
+//
+// image_end of a plain UF2 image counts its side blocks as data, and a short
+// last block as a whole one, so it may lie a sector or more past the actual
+// end. A sector is therefore only erased once data for it came in.
+void erase_ahead(uint32_t addr, bool final)
+{
+    if (!program_state.linear)
+    {
+        return;
+    }
+
+    if (addr >= program_state.image_end || addr >= program_state.data_end)
+    {
+        return;
+    }
+
+    const uint32_t sector_addr = addr - addr % FLASH_SECTOR_SIZE;
+    const uint32_t sector_bit = 1U << ((sector_addr - FLASH_BASE) / FLASH_SECTOR_SIZE);
+    if (program_state.visited_sectors & sector_bit)
+    {
+        return;
+    }
+    const bool changed = buffer_page_differs(addr);
+    if (!changed && !final)
+    {
+        return; // Not known yet
+    }
+    program_state.visited_sectors |= sector_bit;
+    if (!changed)
+    {
+        return;
+    }
+
+    if (sector_addr >= FW_ADDR && sector_addr >= program_state.base_addr //
+        && sector_addr + FLASH_SECTOR_SIZE <= program_state.image_end)
+    {
+        log("erase sector: %08x\n", sector_addr);
+        internal_flash_erase_sector_async(sector_addr);
+    }
+}
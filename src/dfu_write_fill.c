@@ -0,0 +1,55 @@
+#include "dfu_write_priv.h"
+#include "internal_flash.h"
+#include "log.h"
+
+// Fill blocks (UF2_FLAG_MOTO_FILL) stand for a run of blocks of one byte
+// value, 0xff padding mostly.
+
+bool fill_block_valid(const uf2_block_t *block)
+{
+    const uf2_fill_t *const fill = (const uf2_fill_t *)block->data;
+    return sizeof(uf2_fill_t) == block->payload_size && 0 != fill->blocks && 0 != fill->size //
+           && 0 == fill->size % fill->blocks && 0 == (fill->size / fill->blocks) % 4       //
+           && fill->size / fill->blocks <= UF2_MAX_PAYLOAD_SIZE                            //
+           && block->block_no < block->num_blocks && fill->blocks <= block->num_blocks - block->block_no;
+}
+
+uint32_t fill_block_count(const uf2_block_t *block)
+{
+    return ((const uf2_fill_t *)block->data)->blocks;
+}
+
+// Whole pages of 0xff in flash only need erasing, which leaves blank ones
+// alone, unless the page is in the buffer
+static bool fill_by_erase(uint32_t page_addr, uint8_t value)
+{
+    return 0xff == value && !buffer_has_page(page_addr);
+}
+
+void fill_apply(const uf2_block_t *block, uint32_t size)
+{
+    const uint8_t value = ((const uf2_fill_t *)block->data)->value;
+    uint32_t addr = block->target_addr;
+
+    data_received(addr, size);
+    for (uint32_t n; size; addr += n, size -= n)
+    {
+        const uint32_t offset = addr % PAGE_SIZE;
+        n = size < PAGE_SIZE - offset ? size : PAGE_SIZE - offset;
+        if (journal_covers(addr, n))
+        {
+            continue; // Programmed before
+        }
+        if (PAGE_SIZE == n && fill_by_erase(addr, value))
+        {
+            log("erase: %08x\n", addr);
+            internal_flash_erase_page(addr);
+            journal_mark(addr);
+            erase_ahead(addr + PAGE_SIZE, false);
+        }
+        else
+        {
+            buffer_fill(addr, value, n);
+        }
+    }
+}
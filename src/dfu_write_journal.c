@@ -0,0 +1,126 @@
+#include "dfu_write_priv.h"
+#include "internal_flash.h"
+#include "crc.h"
+#include <string.h>
+#include "log.h"
+
+// Flashing journal: which pages of the image being written are programmed,
+// kept at JOURNAL_ADDR so that a copy cut short (unplugged, powered off)
+// resumes when the same image is copied again. Blocks whose pages are all in
+// it are skipped. To spare the flash it is written every
+// DFU_JOURNAL_INTERVAL pages only, and erased once the image is finished.
+#ifndef DFU_JOURNAL_INTERVAL
+#define DFU_JOURNAL_INTERVAL 32 // A sector
+#endif
+
+#define JOURNAL_MAGIC 0x4c4e524aUL // "JRNL"
+
+typedef struct
+{
+    uint32_t magic;
+    // Image identity: the block count, and the block the image started with
+    uint32_t num_blocks;
+    uint32_t first_block_no;
+    uint32_t first_block_crc; // crc_compute_buf() of the whole block
+    uint32_t pages[(FW_PAGE_NUM + 31) / 32]; // Bit map of pages programmed in whole
+} journal_t;
+
+static_assert(sizeof(journal_t) <= PAGE_SIZE);
+
+static struct
+{
+    union
+    {
+        journal_t record;
+        uint8_t page[PAGE_SIZE]; // As programmed
+    };
+    uint32_t unsaved; // Pages marked since the last write
+    uint8_t active;   // The image in progress keeps a journal
+    uint8_t resumed;  // and it came from flash
+} journal = {0};
+
+static inline bool journal_has_page(uint32_t page_addr)
+{
+    const uint32_t i = (page_addr - FW_ADDR) / PAGE_SIZE;
+    return journal.record.pages[i / 32] & (1U << (i % 32));
+}
+
+void journal_clear()
+{
+    journal.active = false;
+    journal.resumed = false;
+    if (JOURNAL_MAGIC == ((const journal_t *)JOURNAL_ADDR)->magic)
+    {
+        internal_flash_erase_page(JOURNAL_ADDR);
+    }
+}
+
+void journal_start(const uf2_block_t *first_block)
+{
+    const journal_t *const saved = (const journal_t *)JOURNAL_ADDR;
+    const uint32_t crc = crc_compute_buf(first_block, sizeof(*first_block));
+
+    if (JOURNAL_MAGIC == saved->magic && first_block->num_blocks == saved->num_blocks //
+        && first_block->block_no == saved->first_block_no && crc == saved->first_block_crc)
+    {
+        memcpy(journal.page, saved, PAGE_SIZE);
+        journal.resumed = true;
+        log("resume\n");
+
+#if defined(ENABLE_ERASE_AHEAD)
+        // Programmed pages must not get erased ahead
+        for (uint32_t i = 0; i < FW_PAGE_NUM; i++)
+        {
+            if (journal.record.pages[i / 32] & (1U << (i % 32)))
+            {
+                program_state.visited_sectors |= 1U << ((FW_ADDR + i * PAGE_SIZE - FLASH_BASE) / FLASH_SECTOR_SIZE);
+            }
+        }
+#endif
+    }
+    else
+    {
+        journal_clear();
+        memset(journal.page, 0xff, PAGE_SIZE);
+        journal.record.magic = JOURNAL_MAGIC;
+        journal.record.num_blocks = first_block->num_blocks;
+        journal.record.first_block_no = first_block->block_no;
+        journal.record.first_block_crc = crc;
+        memset(journal.record.pages, 0, sizeof(journal.record.pages));
+    }
+    journal.unsaved = 0;
+    journal.active = true;
+}
+
+void journal_mark(uint32_t page_addr)
+{
+    if (!journal.active || journal_has_page(page_addr))
+    {
+        return;
+    }
+    const uint32_t i = (page_addr - FW_ADDR) / PAGE_SIZE;
+    journal.record.pages[i / 32] |= 1U << (i % 32);
+
+    // The page is programmed before the journal, which waits for it
+    if (++journal.unsaved >= DFU_JOURNAL_INTERVAL)
+    {
+        internal_flash_program_page(JOURNAL_ADDR, journal.page);
+        journal.unsaved = 0;
+    }
+}
+
+bool journal_covers(uint32_t addr, uint32_t size)
+{
+    if (!journal.resumed)
+    {
+        return false;
+    }
+    for (uint32_t page_addr = addr - addr % PAGE_SIZE; page_addr < addr + size; page_addr += PAGE_SIZE)
+    {
+        if (!journal_has_page(page_addr))
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#include "dfu_write_priv.h"
+#include "lzss.h"
+
+// Compressed blocks (UF2_FLAG_MOTO_LZSS): each one decodes to the data at its
+// target_addr, and names the extent of the whole image in its header, as the
+// decoded sizes differ from block to block.
+
+static uint8_t lzss_buf[UF2_LZSS_MAX_SIZE];
+
+bool lzss_block_valid(const uf2_block_t *block)
+{
+    return block->payload_size > sizeof(uf2_lzss_header_t);
+}
+
+const uint8_t *lzss_block_payload(const uf2_block_t *block, uint32_t *size)
+{
+    const int n = lzss_decode(block->data + sizeof(uf2_lzss_header_t), block->payload_size - sizeof(uf2_lzss_header_t), //
+                              lzss_buf, sizeof(lzss_buf));
+    if (n <= 0)
+    {
+        return NULL;
+    }
+    *size = n;
+    return lzss_buf;
+}
+
+void lzss_block_start(const uf2_block_t *block, uint32_t size)
+{
+    const uf2_lzss_header_t *const header = (const uf2_lzss_header_t *)block->data;
+    program_state.base_addr = header->image_addr;
+    program_state.image_end = header->image_addr + header->image_size;
+    program_state.linear = FW_ADDR <= header->image_addr && header->image_size <= FW_ADDR + FW_SIZE - header->image_addr //
+                           && lzss_block_linear(block, size);
+}
+
+bool lzss_block_linear(const uf2_block_t *block, uint32_t size)
+{
+    const uf2_lzss_header_t *const header = (const uf2_lzss_header_t *)block->data;
+    return header->image_addr == program_state.base_addr                                                 //
+           && header->image_size == program_state.image_end - program_state.base_addr                    //
+           && program_state.base_addr <= block->target_addr && block->target_addr < program_state.image_end //
+           && size <= program_state.image_end - block->target_addr;
+}
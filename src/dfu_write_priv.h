@@ -0,0 +1,199 @@
+#ifndef _DFU_WRITE_PRIV_H
+#define _DFU_WRITE_PRIV_H
+
+// Inside of the image writer: dfu_write.c takes the UF2 blocks the host
+// writes and programs them through a page buffer, and calls into the
+// dfu_write_*.c file of each optional feature, which the Makefile only builds
+// with its ENABLE_ option. Without it, its calls below do nothing.
+
+#include "dfu.h"
+#include "dfu_write.h"
+#include "uf2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 256
+#define PAGE_WORDS (PAGE_SIZE / 4)
+
+// Blocks in an image, at most: a whole one still fits with its verify block
+#define MAX_BLOCKS (FW_PAGE_NUM + 1)
+
+typedef struct
+{
+    uint32_t base_addr; // Address of block 0, if the image is linear
+    uint32_t image_end;
+    uint32_t data_end; // Past the highest byte received so far, see erase_ahead()
+    // uint32_t num_pages;
+    uint32_t block_size;      // Payload size of the first block received
+    uint32_t last_block_no;
+    uint32_t visited_sectors; // Bit map of flash sectors already written to
+    uint8_t linear;           // Every block so far is where the first one puts it, see block_linear()
+    uint8_t in_progress;
+} program_state_t;
+
+extern program_state_t program_state;
+
+// Also where program_finished() gets the count from
+extern dfu_write_stats_t write_stats;
+
+// dfu_write.c ----------
+
+void buffer_payload(uint32_t addr, const uint8_t *data, uint32_t size);
+
+// Sets [addr, addr + size), all in one page, to value
+void buffer_fill(uint32_t addr, uint8_t value, uint32_t size);
+
+bool buffer_has_page(uint32_t page_addr);
+// Whether words of the page in the buffer differ from flash
+bool buffer_page_differs(uint32_t page_addr);
+
+bool block_received(uint32_t block_no);
+void mark_block(uint32_t block_no);
+
+// dfu_write_erase.c, ENABLE_ERASE_AHEAD ----------
+
+#if defined(ENABLE_ERASE_AHEAD)
+// Called for the first block of a plain image
+void erase_start(const uf2_block_t *block, uint32_t size);
+// Called for every block applied
+void erase_track(const uf2_block_t *block, uint32_t size);
+// Called for all data of the image, incl. what does not go through the page
+// buffer
+void data_received(uint32_t addr, uint32_t size);
+// Erases the sector of addr in one go if the image covers all of it, it has
+// not been yet, and what the buffer has of the page at addr changes it.
+// final: the page is about to be programmed, so the buffer has all there is.
+void erase_ahead(uint32_t addr, bool final);
+#else
+static inline void erase_start(const uf2_block_t *block, uint32_t size)
+{
+}
+
+static inline void erase_track(const uf2_block_t *block, uint32_t size)
+{
+}
+
+static inline void data_received(uint32_t addr, uint32_t size)
+{
+}
+
+static inline void erase_ahead(uint32_t addr, bool final)
+{
+}
+#endif
+
+// dfu_write_lzss.c, ENABLE_UF2_LZSS ----------
+
+#if defined(ENABLE_UF2_LZSS)
+bool lzss_block_valid(const uf2_block_t *block);
+// The decoded data and its size, or NULL
+const uint8_t *lzss_block_payload(const uf2_block_t *block, uint32_t *size);
+// Sets the image extent from the first block
+void lzss_block_start(const uf2_block_t *block, uint32_t size);
+bool lzss_block_linear(const uf2_block_t *block, uint32_t size);
+#else
+static inline bool lzss_block_valid(const uf2_block_t *block)
+{
+    return false; // Compressed, which this build cannot decode
+}
+
+static inline const uint8_t *lzss_block_payload(const uf2_block_t *block, uint32_t *size)
+{
+    return NULL;
+}
+
+static inline void lzss_block_start(const uf2_block_t *block, uint32_t size)
+{
+}
+
+static inline bool lzss_block_linear(const uf2_block_t *block, uint32_t size)
+{
+    return false;
+}
+#endif
+
+// dfu_write_fill.c, ENABLE_UF2_FILL ----------
+
+#if defined(ENABLE_UF2_FILL)
+bool fill_block_valid(const uf2_block_t *block);
+// Blocks the fill block stands for
+uint32_t fill_block_count(const uf2_block_t *block);
+void fill_apply(const uf2_block_t *block, uint32_t size);
+#else
+static inline bool fill_block_valid(const uf2_block_t *block)
+{
+    return false;
+}
+
+static inline uint32_t fill_block_count(const uf2_block_t *block)
+{
+    return 1;
+}
+
+static inline void fill_apply(const uf2_block_t *block, uint32_t size)
+{
+}
+#endif
+
+// dfu_write_journal.c, ENABLE_RESUME ----------
+
+#if defined(ENABLE_RESUME)
+// Picks up the journal in flash if first_block starts the image it is for,
+// or else starts a new one
+void journal_start(const uf2_block_t *first_block);
+// Called once a page the image fills in whole is programmed
+void journal_mark(uint32_t page_addr);
+// Whether the pages of [addr, addr + size) got programmed before
+bool journal_covers(uint32_t addr, uint32_t size);
+void journal_clear();
+#else
+static inline void journal_start(const uf2_block_t *first_block)
+{
+}
+
+static inline void journal_mark(uint32_t page_addr)
+{
+}
+
+static inline bool journal_covers(uint32_t addr, uint32_t size)
+{
+    return false;
+}
+
+static inline void journal_clear()
+{
+}
+#endif
+
+// dfu_write_verify.c, ENABLE_UF2_VERIFY ----------
+
+#if defined(ENABLE_UF2_VERIFY)
+bool verify_block_valid(const uf2_block_t *block);
+// Keeps the block's record for verify_check()
+void verify_keep(const uf2_block_t *block);
+void verify_clear();
+// Checks the image written against the record kept, and fills in verify,
+// see DFU_VERIFY_*
+uint8_t verify_check(dfu_verify_t *verify);
+#else
+static inline bool verify_block_valid(const uf2_block_t *block)
+{
+    return true; // Counts, but is not checked
+}
+
+static inline void verify_keep(const uf2_block_t *block)
+{
+}
+
+static inline void verify_clear()
+{
+}
+
+static inline uint8_t verify_check(dfu_verify_t *verify)
+{
+    return DFU_VERIFY_NONE;
+}
+#endif
+
+#endif // _DFU_WRITE_PRIV_H
@@ -0,0 +1,47 @@
+#include "dfu_write_priv.h"
+#include "crc.h"
+#include <string.h>
+#include "log.h"
+
+// Verify blocks: the image is checked against the CRC the block carries once
+// written, see dfu_write_get_verify()
+static struct
+{
+    uf2_verify_t record;
+    bool pending;
+} verify_block = {0};
+
+bool verify_block_valid(const uf2_block_t *block)
+{
+    const uf2_verify_t *const record = (const uf2_verify_t *)block->data;
+    return sizeof(uf2_verify_t) == block->payload_size                                            //
+           && record->image_addr >= FW_ADDR && record->image_addr < FW_ADDR + FW_SIZE              //
+           && 0 == record->image_size % 4 && record->image_size <= FW_ADDR + FW_SIZE - record->image_addr;
+}
+
+void verify_keep(const uf2_block_t *block)
+{
+    memcpy(&verify_block.record, block->data, sizeof(verify_block.record));
+    verify_block.pending = true;
+}
+
+void verify_clear()
+{
+    verify_block.pending = false;
+}
+
+uint8_t verify_check(dfu_verify_t *verify)
+{
+    if (!verify_block.pending)
+    {
+        return DFU_VERIFY_NONE;
+    }
+    verify_block.pending = false;
+
+    verify->image_addr = verify_block.record.image_addr;
+    verify->image_size = verify_block.record.image_size;
+    verify->expected_crc = verify_block.record.image_crc;
+    verify->actual_crc = crc_compute(verify->image_addr, verify->image_size);
+    log("verify: %08x, %08x\n", verify->expected_crc, verify->actual_crc);
+    return verify->actual_crc == verify->expected_crc ? DFU_VERIFY_PASS : DFU_VERIFY_FAIL;
+}
@@ -40,6 +40,7 @@ static_assert(sizeof(fat_boot_sector_t) == 62);
 
 #define FAT16_ENTRY_FREE 0
 #define FAT16_ENTRY_EOF 0xffff
+#define FAT16_ENTRY_EOF_MIN 0xfff8 // Any entry from here on ends a chain
 
 #define FAT12_ENTRY_FREE 0
 #define FAT12_ENTRY_EOF 0xfff
@@ -77,6 +78,7 @@ enum
     FAT_DIR_ATTR_VOLUME_ID = 0x8,
     FAT_DIR_ATTR_DIR = 0x10,
     FAT_DIR_ATTR_ARCHIVE = 0x20,
+    FAT_DIR_ATTR_LONG_NAME = 0xf, // All of RO, HIDDEN, SYSTEM and VOLUME_ID
 };
 
 // Misc --------------
@@ -3,9 +3,12 @@
 
 #include "py32f0xx.h"
 #include <assert.h>
+#include <stdbool.h>
 
 #define _BL_SIZE 0x2800 // 10 KB
 #define FW_ADDR (FLASH_BASE + _BL_SIZE)
+// Last page of the bootloader area, left out of its code (see py32f071xb.ld)
+#define JOURNAL_ADDR (FW_ADDR - FLASH_PAGE_SIZE)
 // #define FW_ADDR (FLASH_BASE + 64 * 1024) // This is for test! 0x08010000
 
 static_assert(0 == FW_ADDR % FLASH_PAGE_SIZE);
@@ -13,4 +16,45 @@ static_assert(0 == FW_ADDR % FLASH_PAGE_SIZE);
 #define FW_SIZE (FLASH_END + 1 - FW_ADDR)
 #define FW_PAGE_NUM (FW_SIZE / FLASH_PAGE_SIZE)
 
+// Whether vec (the start of an image built for FW_ADDR) holds a plausible
+// initial SP and reset handler
+static inline bool fw_vectors_valid(const uint32_t *vec)
+{
+    const uint32_t sp = vec[0];
+    if (0 != sp % 2 || sp <= SRAM_BASE || sp > (1 + SRAM_END))
+    {
+        return false;
+    }
+
+    uint32_t reset_handler = vec[1];
+    if (0 == reset_handler % 2)
+    {
+        return false;
+    }
+    reset_handler -= 1;
+    return reset_handler >= FW_ADDR + 8 && reset_handler < (1 + FLASH_END);
+}
+
+// RAM mailbox: the last bytes of RAM, which the bootloader keeps its stack out
+// of (see _estack in py32f071xb.ld), so what it leaves there is still there
+// when the firmware starts. The firmware's own stack soon overwrites it.
+#define FW_MAILBOX_SIZE 16
+
+typedef struct
+{
+    uint32_t boot_magic;  // FW_MAILBOX_BOOT_MAGIC once boot_cycles is set
+    uint32_t boot_cycles; // Core clock cycles from the startup code to fw_boot0, see ENABLE_BOOT_TIMING
+    uint32_t dfu_magic;   // Set by the firmware, see FW_MAILBOX_DFU_MAGIC
+} fw_mailbox_t;
+
+static_assert(sizeof(fw_mailbox_t) <= FW_MAILBOX_SIZE);
+
+#define FW_MAILBOX ((volatile fw_mailbox_t *)(SRAM_END + 1 - FW_MAILBOX_SIZE))
+#define FW_MAILBOX_BOOT_MAGIC 0x544f4f42 // "BOOT"
+
+// The firmware asks for DFU mode by writing this to dfu_magic, i.e. the word at
+// 0x20003ff8, then resetting with NVIC_SystemReset(). The bootloader checks it
+// ahead of the keys, and clears it whether it matches or not.
+#define FW_MAILBOX_DFU_MAGIC 0x4d554644 // "DFUM"
+
 #endif // _FW_H
@@ -1,41 +1,61 @@
 #include "fw_boot.h"
 #include <stdint.h>
 #include "fw.h"
-#include "log.h"
+#include "board.h"
 #include "py32f0xx.h"
 
-bool fw_is_bootable()
-{
-    const uint32_t *vec = (uint32_t *)FW_ADDR;
+// Core clock until main() sets up the PLL: HSI at 8 MHz (see SystemInit())
+#define BOOT_CLOCK_MHZ 8
 
-    log("check fw: vec = %08x, sp = %08x, reset handler = %08x\n", (uint32_t)vec, vec[0], vec[1]);
+// Time the pulled-up key inputs get before they are read
+#ifndef BOOT_KEY_SETTLE_US
+#define BOOT_KEY_SETTLE_US 200
+#endif
 
-    uint32_t sp = vec[0];
-    if (0 != sp % 2 || sp <= SRAM_BASE || sp > (1 + SRAM_END))
-    {
-        return false;
-    }
+extern void fw_boot0(const uint32_t *vec);
+
+static inline uint32_t systick_elapsed()
+{
+    return SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
+}
 
-    uint32_t reset_handler = vec[1];
-    if (0 == reset_handler % 2)
+void fw_boot_early()
+{
+    // Free running from here, counting core clock cycles
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    // DFU mode if the firmware asked for it, see FW_MAILBOX_DFU_MAGIC. Cleared
+    // first, so the next reset boots as usual.
+    const uint32_t dfu_magic = FW_MAILBOX->dfu_magic;
+    FW_MAILBOX->dfu_magic = 0;
+    if (FW_MAILBOX_DFU_MAGIC == dfu_magic)
     {
-        return false;
+        SysTick->CTRL = 0;
+        return;
     }
-    reset_handler -= 1;
-    if (reset_handler < FW_ADDR + 8 || reset_handler >= (1 + FLASH_END))
+
+    board_init_keys();
+    while (systick_elapsed() < BOOT_KEY_SETTLE_US * BOOT_CLOCK_MHZ)
     {
-        return false;
     }
 
-    return true;
-}
-
-void fw_boot()
-{
+    // DFU mode on PTT, unless a side key is held as well
     const uint32_t *vec = (uint32_t *)FW_ADDR;
+    if ((board_check_PTT() && !board_check_side_keys()) || !fw_vectors_valid(vec))
+    {
+        SysTick->CTRL = 0;
+        return;
+    }
 
-    log("boot fw: vec = %08x, sp = %08x, reset handler = %08x\n", (uint32_t)vec, vec[0], vec[1]);
+#if defined(ENABLE_BOOT_TIMING)
+    FW_MAILBOX->boot_cycles = systick_elapsed();
+    FW_MAILBOX->boot_magic = FW_MAILBOX_BOOT_MAGIC;
+#endif
+    SysTick->CTRL = 0;
 
-    extern void fw_boot0(const uint32_t *vec);
+    // Still the vector table in flash: the startup code has not moved it to
+    // RAM yet
     fw_boot0(vec);
 }
@@ -1,9 +1,10 @@
 #ifndef _FW_BOOT_H
 #define _FW_BOOT_H
 
-#include <stdbool.h>
-
-bool fw_is_bootable();
-void fw_boot();
+// Called by the startup code ahead of the C runtime set-up, so nothing in
+// .data, .bss or .ramfunc may be used. Boots the firmware on the reset clock,
+// which sets up the clocks itself anyway, unless DFU mode is asked for or
+// there is no firmware. Returns for DFU mode.
+void fw_boot_early();
 
 #endif // _FW_BOOT_H
@@ -1,17 +1,23 @@
 #include "internal_flash.h"
 #include <stdbool.h>
-#include <string.h>
+#include "main.h"
 #include "py32f071_ll_flash.h"
 #include "py32f071_ll_utils.h"
 
-static inline void wait_BSY()
+// The driver runs while the flash is busy, so nothing it calls may be fetched
+// from flash: helpers are always_inline, and the entry points are flattened,
+// which inlines the LL and CMSIS inlines they use as well
+#define FLASH_INLINE __attribute__((always_inline)) static inline
+#define FLASH_RAMFUNC RAMFUNC __attribute__((flatten))
+
+FLASH_INLINE void wait_BSY()
 {
     while (LL_FLASH_IsActiveFlag_BUSY(FLASH))
     {
     }
 }
 
-static inline void wait_EOP()
+FLASH_INLINE void wait_EOP()
 {
     while (!LL_FLASH_IsActiveFlag_EOP(FLASH))
     {
@@ -19,7 +25,7 @@ static inline void wait_EOP()
     LL_FLASH_ClearFlag_EOP(FLASH);
 }
 
-static bool page_need_erase(uint32_t addr)
+FLASH_INLINE bool page_need_erase(uint32_t addr)
 {
     const uint8_t *p = (uint8_t *)addr;
     for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i++)
@@ -32,41 +38,140 @@ static bool page_need_erase(uint32_t addr)
     return false;
 }
 
-static void page_erase(uint32_t addr)
+// memcmp() is in flash
+FLASH_INLINE bool page_equal(uint32_t addr, const uint8_t *buf)
 {
-    wait_BSY();
-    LL_FLASH_Unlock(FLASH);
-    LL_FLASH_EnablePageErase(FLASH);
-    LL_FLASH_EnableIT_EOP(FLASH);
-    *((uint32_t *)((addr / 4) * 4)) = 0xffffffffU;
-    wait_BSY();
-    wait_EOP();
+    const uint8_t *p = (uint8_t *)addr;
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE; i++)
+    {
+        if (buf[i] != p[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Async operations ----------
+//
+// Sector erase and page program are started and left running; the FLASH EOP
+// interrupt (or the next flash operation, whichever comes first) finishes
+// them off. This lets the next UF2 block come in over USB meanwhile. Page
+// erase is set up the same way, but waited for, as the program follows.
+//
+// Whatever runs while the flash is busy must not be fetched from it, so the
+// driver is RAMFUNC. The USB stack runs from flash, so USB_IRQHandler() below
+// holds the interrupt off until the operation is done.
+
+static volatile bool op_pending = false;
+static volatile bool usb_held = false;
+
+// Shared by FLASH_IRQHandler() and internal_flash_wait(), not inlined into
+// both (RAMFUNC is noinline)
+static FLASH_RAMFUNC void op_done()
+{
+    NVIC_DisableIRQ(FLASH_IRQn);
+    LL_FLASH_ClearFlag_EOP(FLASH);
     LL_FLASH_DisableIT_EOP(FLASH);
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PER | FLASH_CR_SER | FLASH_CR_PG);
     LL_FLASH_Lock(FLASH);
+    op_pending = false;
+    if (usb_held)
+    {
+        usb_held = false;
+        NVIC_EnableIRQ(USB_IRQn);
+    }
 }
 
-void internal_flash_program_page(uint32_t addr, const uint8_t *buf)
+FLASH_RAMFUNC void FLASH_IRQHandler(void)
 {
-    // Test code
-    // LL_mDelay(20);
-    // return;
+    if (op_pending && LL_FLASH_IsActiveFlag_EOP(FLASH))
+    {
+        op_done();
+    }
+}
 
-    if (0 == memcmp((void *)addr, buf, FLASH_PAGE_SIZE))
+FLASH_RAMFUNC void internal_flash_wait()
+{
+    NVIC_DisableIRQ(FLASH_IRQn);
+    if (op_pending)
     {
-        return;
+        wait_BSY();
+        wait_EOP();
+        op_done();
     }
+}
 
-    if (page_need_erase(addr))
+void usbd_irq_handler(void);
+
+// The USB stack runs from flash, so the interrupt waits for the operation
+// pending, masked until op_done() instead of stalling on the flash. Not
+// flattened, which would pull the stack in.
+RAMFUNC void USB_IRQHandler(void)
+{
+    if (op_pending)
     {
-        page_erase(addr);
+        NVIC->ICER[0] = 1U << USB_IRQn; // NVIC_DisableIRQ(), which is in flash unless inlined
+        usb_held = true;
+        return;
     }
+    usbd_irq_handler();
+}
+
+bool internal_flash_is_busy()
+{
+    return op_pending;
+}
 
+// Sets up the operation of the FLASH_CR bits in cr (FLASH_CR_PER, _SER or
+// _PG, which op_done() clears). Must be called before the write that starts
+// it.
+static FLASH_RAMFUNC void op_start(uint32_t cr)
+{
+    internal_flash_wait();
     wait_BSY();
     LL_FLASH_Unlock(FLASH);
-    LL_FLASH_EnablePageProgram(FLASH);
+    SET_BIT(FLASH->CR, cr);
     LL_FLASH_EnableIT_EOP(FLASH);
+    op_pending = true;
+    NVIC_ClearPendingIRQ(FLASH_IRQn);
+    NVIC_EnableIRQ(FLASH_IRQn);
+}
 
-    uint32_t *const p = (uint32_t *)addr;
+FLASH_RAMFUNC void internal_flash_erase_sector_async(uint32_t addr)
+{
+    op_start(FLASH_CR_SER);
+    *((uint32_t *)(addr - addr % FLASH_SECTOR_SIZE)) = 0xffffffffU;
+}
+
+FLASH_RAMFUNC void internal_flash_erase_page(uint32_t addr)
+{
+    internal_flash_wait();
+    if (page_need_erase(addr))
+    {
+        op_start(FLASH_CR_PER);
+        *((uint32_t *)((addr / 4) * 4)) = 0xffffffffU;
+        internal_flash_wait();
+    }
+}
+
+FLASH_RAMFUNC bool internal_flash_program_page(uint32_t addr, const uint8_t *buf)
+{
+    // Test code
+    // LL_mDelay(20);
+    // return true;
+
+    internal_flash_wait();
+
+    if (page_equal(addr, buf))
+    {
+        return false;
+    }
+
+    internal_flash_erase_page(addr);
+    op_start(FLASH_CR_PG);
+
+    volatile uint32_t *const p = (uint32_t *)addr;
     for (uint32_t i = 0; i < 63; i++)
     {
         uint32_t n = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
@@ -82,9 +187,5 @@ void internal_flash_program_page(uint32_t addr, const uint8_t *buf)
         p[63] = n;
     } while (0);
 
-    wait_BSY();
-    wait_EOP();
-    LL_FLASH_DisableIT_EOP(FLASH);
-    LL_FLASH_DisablePageProgram(FLASH);
-    LL_FLASH_Lock(FLASH);
+    return true;
 }
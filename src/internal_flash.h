@@ -2,7 +2,18 @@
 #define _INTERNAL_FLASH_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-void internal_flash_program_page(uint32_t addr, const uint8_t *buf);
+// Program and sector erase return once the operation has started; buf may be
+// reused right away. Returns false if the page holds buf already and was left
+// alone.
+bool internal_flash_program_page(uint32_t addr, const uint8_t *buf);
+// Erases the FLASH_SECTOR_SIZE sector containing addr
+void internal_flash_erase_sector_async(uint32_t addr);
+// Erases the page at addr unless blank, and waits for it
+void internal_flash_erase_page(uint32_t addr);
+// Wait for the pending operation, which every other flash operation does first
+void internal_flash_wait();
+bool internal_flash_is_busy();
 
 #endif // _INTERNAL_FLASH_H
@@ -5,12 +5,14 @@
 #include "py32f071_ll_spi.h"
 #include "py32f071_ll_bus.h"
 #include "py32f071_ll_utils.h"
+#include "main.h"
 
 #define SPIx SPI1
-#define SYSTEM_DelayMs LL_mDelay
 
 #define LCD_WIDTH 128
 #define LCD_HEIGHT 64
+// Rows of 8 pixels, one byte per column
+#define LCD_PAGES (LCD_HEIGHT / 8)
 
 static void SPI_Init()
 {
@@ -137,20 +139,36 @@ static uint8_t SPI_WriteByte(uint8_t Value)
 // D=0, display OFF
 #define ST7565_CMD_DISPLAY_ON_OFF 0xAE
 
-static const uint8_t cmds[] = {
+// The set-up after the software reset, as runs of commands: the wait before
+// the run (ms), the number of commands in it, then the commands
+static const uint8_t SETUP[] = {
+    120,
+    9,
     ST7565_CMD_BIAS_SELECT | 0,             // Select bias setting: 1/9
     ST7565_CMD_COM_DIRECTION | (0 << 3),    // Set output direction of COM: normal
     ST7565_CMD_SEG_DIRECTION | 1,           // Set scan direction of SEG: reverse
     ST7565_CMD_INVERSE_DISPLAY | 0,         // Inverse Display: false
     ST7565_CMD_ALL_PIXEL_ON | 0,            // All Pixel ON: false - normal display
     ST7565_CMD_REGULATION_RATIO | (4 << 0), // Regulation Ratio 5.0
-
-    ST7565_CMD_SET_EV, // Set contrast
+    ST7565_CMD_SET_EV,                      // Set contrast
     31,
-
-    ST7565_CMD_POWER_CIRCUIT | 0b111, // Built-in power circuit ON/OFF: VB=1 VR=1 VF=1
-    ST7565_CMD_SET_START_LINE | 0,    // Set Start Line: 0
-    ST7565_CMD_DISPLAY_ON_OFF | 1,    // Display ON/OFF: ON
+    ST7565_CMD_POWER_CIRCUIT | 0b011, // VB=0 VR=1 VF=1
+
+    1,
+    1,
+    ST7565_CMD_POWER_CIRCUIT | 0b110, // VB=1 VR=1 VF=0
+
+    1,
+    4, // why 4 times?
+    ST7565_CMD_POWER_CIRCUIT | 0b111, // VB=1 VR=1 VF=1
+    ST7565_CMD_POWER_CIRCUIT | 0b111,
+    ST7565_CMD_POWER_CIRCUIT | 0b111,
+    ST7565_CMD_POWER_CIRCUIT | 0b111,
+
+    40,
+    2,
+    ST7565_CMD_SET_START_LINE | 0, // line 0
+    ST7565_CMD_DISPLAY_ON_OFF | 1, // D=1
 };
 
 /**
@@ -180,54 +198,34 @@ static void DrawLine(uint8_t column, uint8_t line, const uint8_t *lineBuffer, ui
     }
 }
 
-static void ST7565_FillScreen(uint8_t value)
+static void ST7565_FillPage(uint8_t page, uint8_t value)
 {
     CS_Assert();
-    for (unsigned i = 0; i < LCD_HEIGHT; i++)
+    ST7565_SelectColumnAndLine(4, page);
+    A0_Set();
+    for (uint32_t x = 0; x < LCD_WIDTH; x++)
     {
-        ST7565_SelectColumnAndLine(4, i);
-        A0_Set();
-        for (uint32_t x = 0; x < LCD_WIDTH; x++)
-        {
-            SPI_WriteByte(value);
-        }
+        SPI_WriteByte(value);
     }
     CS_Release();
 }
 
-void ST7565_Init(void)
+static void ST7565_FillScreen(uint8_t value)
 {
-    SPI_Init();
-    CS_Assert();
-    ST7565_WriteByte(ST7565_CMD_SOFTWARE_RESET); // software reset
-    SYSTEM_DelayMs(120);
-
-    for (uint8_t i = 0; i < 8; i++)
+    for (uint8_t i = 0; i < LCD_PAGES; i++)
     {
-        ST7565_WriteByte(cmds[i]);
+        ST7565_FillPage(i, value);
     }
-
-    ST7565_WriteByte(ST7565_CMD_POWER_CIRCUIT | 0b011); // VB=0 VR=1 VF=1
-    SYSTEM_DelayMs(1);
-    ST7565_WriteByte(ST7565_CMD_POWER_CIRCUIT | 0b110); // VB=1 VR=1 VF=0
-    SYSTEM_DelayMs(1);
-
-    for (uint8_t i = 0; i < 4; i++)                         // why 4 times?
-        ST7565_WriteByte(ST7565_CMD_POWER_CIRCUIT | 0b111); // VB=1 VR=1 VF=1
-
-    SYSTEM_DelayMs(40);
-
-    ST7565_WriteByte(ST7565_CMD_SET_START_LINE | 0); // line 0
-    ST7565_WriteByte(ST7565_CMD_DISPLAY_ON_OFF | 1); // D=1
-
-    CS_Release();
-
-    ST7565_FillScreen(0x00);
 }
 
 static const uint8_t M[] = {0xFC, 0xFC, 0x18, 0x70, 0x18, 0xFC, 0xFC, /*0x00,*/ 0x0F, 0x0F, 0x00, 0x00, 0x00, 0x0F, 0x0F};
 static const uint8_t O[] = {0xF8, 0xFC, 0x04, 0x04, 0x04, 0xFC, 0xF8, /*0x00,*/ 0x07, 0x0F, 0x08, 0x08, 0x08, 0x0F, 0x07};
 static const uint8_t T[] = {0x00, 0x04, 0x04, 0xFC, 0xFC, 0x04, 0x04, /*0x00,*/ 0x00, 0x00, 0x00, 0x0F, 0x0F, 0x00, 0x00};
+#if defined(LCD_VERIFY)
+static const uint8_t K[] = {0xFC, 0xFC, 0xE0, 0xB0, 0x18, 0x0C, 0x04, /*0x00,*/ 0x0F, 0x0F, 0x00, 0x01, 0x03, 0x06, 0x0C};
+static const uint8_t E[] = {0xFC, 0xFC, 0x84, 0x84, 0x84, 0x84, 0x04, /*0x00,*/ 0x0F, 0x0F, 0x08, 0x08, 0x08, 0x08, 0x08};
+static const uint8_t R[] = {0xFC, 0xFC, 0x84, 0x84, 0x84, 0xFC, 0x78, /*0x00,*/ 0x0F, 0x0F, 0x00, 0x01, 0x03, 0x0E, 0x0C};
+#endif
 
 #define FONT_WIDTH 7
 
@@ -239,32 +237,131 @@ static const uint8_t *LOGO[] = {M, O, T, O};
 #define LOGO_FONT_WIDTH 10
 #define LOGO_LEFT ((LCD_WIDTH - LOGO_LEN * LOGO_FONT_WIDTH) / 2)
 
-void lcd_init()
+#if defined(LCD_VERIFY)
+static const uint8_t *VERIFY_PASS[] = {O, K};
+static const uint8_t *VERIFY_FAIL[] = {E, R, R};
+
+#define VERIFY_TOP (LOGO_TOP + 3)
+#endif
+
+// lcd_display_*() only note what to show, lcd_process() draws it. They may
+// come from the USB interrupt.
+static struct
 {
-    ST7565_Init();
-}
+    uint32_t due; // main_timestamp() from which on the next run may go
+    uint8_t pos;  // Of the next run in SETUP, sizeof(SETUP) once done
 
-void lcd_clear()
+    volatile bool logo;
+    volatile uint8_t verify; // 0: none, 1: pass, 2: fail
+    volatile bool changed;
+} lcd;
+
+static void lcd_wait()
 {
-    ST7565_FillScreen(0);
+    // A tick may be about to come, so one more
+    lcd.due = main_timestamp() + SETUP[lcd.pos] + 1;
 }
 
-void lcd_display_logo()
+// Text in the logo font, centered
+static void draw_text(const uint8_t *const *text, uint32_t len, uint32_t top)
 {
-    ST7565_FillScreen(0);
+    const uint32_t left = (LCD_WIDTH - len * LOGO_FONT_WIDTH) / 2;
 
     CS_Assert();
 
     for (uint32_t y = 0; y < 2; y++)
     {
-        uint32_t y1 = y + LOGO_TOP;
+        uint32_t y1 = y + top;
         uint32_t off = FONT_WIDTH * y;
-        for (uint32_t x = 0; x < 4; x++)
+        for (uint32_t x = 0; x < len; x++)
         {
-            uint32_t x1 = LOGO_LEFT + x * LOGO_FONT_WIDTH;
-            DrawLine(x1, y1, LOGO[x] + off, FONT_WIDTH);
+            uint32_t x1 = left + x * LOGO_FONT_WIDTH;
+            DrawLine(x1, y1, text[x] + off, FONT_WIDTH);
         }
     }
 
     CS_Release();
 }
+
+// Starts the set-up, which lcd_process() carries on with
+void lcd_init()
+{
+    SPI_Init();
+    CS_Assert();
+    ST7565_WriteByte(ST7565_CMD_SOFTWARE_RESET); // software reset
+    CS_Release();
+    lcd_wait();
+}
+
+void lcd_process()
+{
+    if (lcd.pos < sizeof(SETUP))
+    {
+        if ((int32_t)(main_timestamp() - lcd.due) < 0)
+        {
+            return;
+        }
+        const uint8_t *const run = SETUP + lcd.pos;
+        CS_Assert();
+        for (uint32_t i = 0; i < run[1]; i++)
+        {
+            ST7565_WriteByte(run[2 + i]);
+        }
+        CS_Release();
+        lcd.pos += 2 + run[1];
+        if (lcd.pos < sizeof(SETUP))
+        {
+            lcd_wait();
+        }
+        else
+        {
+            lcd.changed = true; // The display RAM holds noise until cleared
+        }
+        return;
+    }
+
+    if (!lcd.changed)
+    {
+        return;
+    }
+    // Cleared first: if asked for something else while drawing, it is drawn
+    // on the next call
+    lcd.changed = false;
+    ST7565_FillScreen(0);
+    if (lcd.logo)
+    {
+        draw_text(LOGO, LOGO_LEN, LOGO_TOP);
+    }
+#if defined(LCD_VERIFY)
+    if (lcd.verify)
+    {
+        const bool pass = 1 == lcd.verify;
+        draw_text(pass ? VERIFY_PASS : VERIFY_FAIL, pass ? 2 : 3, VERIFY_TOP);
+    }
+#endif
+}
+
+void lcd_clear()
+{
+    lcd.logo = false;
+    lcd.verify = 0;
+    if (lcd.pos == sizeof(SETUP))
+    {
+        ST7565_FillScreen(0);
+    }
+}
+
+void lcd_display_logo()
+{
+    lcd.logo = true;
+    lcd.verify = 0;
+    lcd.changed = true;
+}
+
+#if defined(LCD_VERIFY)
+void lcd_display_verify(bool pass)
+{
+    lcd.verify = pass ? 1 : 2;
+    lcd.changed = true;
+}
+#endif
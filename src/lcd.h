@@ -1,8 +1,24 @@
 #ifndef _LCD_H
 #define _LCD_H
 
+#include <stdbool.h>
+
+// Non-blocking: the set-up takes some 160 ms, stepped by lcd_process() from
+// the main loop, which also draws what the calls below ask for.
 void lcd_init();
+void lcd_process();
+// Right away, unless still setting up
 void lcd_clear();
 void lcd_display_logo();
 
+// "OK" or "ERR" under the logo, in builds that tell how writing an image went
+#if defined(ENABLE_UF2_VERIFY) || defined(ENABLE_STAY_IN_DFU)
+#define LCD_VERIFY
+void lcd_display_verify(bool pass);
+#else
+static inline void lcd_display_verify(bool pass)
+{
+}
+#endif
+
 #endif
@@ -0,0 +1,52 @@
+#include "lzss.h"
+
+static uint32_t get_bits(const uint8_t *src, uint32_t *pos, uint32_t n)
+{
+    uint32_t v = 0;
+    while (n--)
+    {
+        v = (v << 1) | ((src[*pos / 8] >> (7 - *pos % 8)) & 1);
+        (*pos)++;
+    }
+    return v;
+}
+
+int lzss_decode(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size)
+{
+    const uint32_t total = src_size * 8;
+    uint32_t pos = 0;
+    uint32_t n = 0;
+
+    // A literal is the shortest symbol
+    while (pos + 1 + 8 <= total)
+    {
+        if (get_bits(src, &pos, 1))
+        {
+            if (n >= dst_size)
+            {
+                return -1;
+            }
+            dst[n++] = get_bits(src, &pos, 8);
+            continue;
+        }
+
+        if (pos + LZSS_OFFSET_BITS + LZSS_LENGTH_BITS > total)
+        {
+            break;
+        }
+        const uint32_t offset = get_bits(src, &pos, LZSS_OFFSET_BITS) + 1;
+        uint32_t len = get_bits(src, &pos, LZSS_LENGTH_BITS) + LZSS_MIN_MATCH;
+        if (offset > n || len > dst_size - n)
+        {
+            return -1;
+        }
+        // May overlap, e.g. runs
+        while (len--)
+        {
+            dst[n] = dst[n - offset];
+            n++;
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,16 @@
+#ifndef _LZSS_H
+#define _LZSS_H
+
+#include <stdint.h>
+
+// LZSS bit stream, MSB first: 1 + 8-bit literal, or 0 + (offset - 1) in
+// LZSS_OFFSET_BITS + (length - LZSS_MIN_MATCH) in LZSS_LENGTH_BITS, copied
+// from the output so far. Trailing bits too few for a symbol are padding.
+#define LZSS_OFFSET_BITS 10
+#define LZSS_LENGTH_BITS 4
+#define LZSS_MIN_MATCH 2
+
+// Returns the decoded size, or -1 if the stream is invalid or does not fit
+int lzss_decode(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size);
+
+#endif // _LZSS_H
@@ -33,19 +33,16 @@
 #include "usb_config.h"
 #include "log.h"
 #include "board.h"
-#include "fw_boot.h"
 #include "lcd.h"
-
-typedef enum
-{
-    BOOT_FW,
-    BOOT_DFU,
-} BootMode_t;
+#include "internal_flash.h"
+#include "usb_fs.h"
+#if defined(CONFIG_USBDEV_MSC_THREAD)
+#include "usb_osal.h"
+#endif
 
 static void APP_SystemClockConfig();
 static void APP_SysTick_Init();
 static void APP_USB_Init();
-static BootMode_t GetBootMode();
 
 #if defined(ENABLE_LOGGING)
 #define USARTx USART1
@@ -81,6 +78,9 @@ void SysTick_Handler(void)
  */
 int main()
 {
+    // DFU mode: the startup code boots the firmware otherwise, see
+    // fw_boot_early()
+
     /* System clock configuration */
     APP_SystemClockConfig();
 
@@ -97,23 +97,15 @@ int main()
     log_init();
 #endif
 
-    BootMode_t boot_mode = GetBootMode();
-    if (BOOT_FW == boot_mode && fw_is_bootable())
-    {
-        NVIC_DisableIRQ(SysTick_IRQn);
-        SysTick->CTRL = 0; // Disable
-        fw_boot();
-    }
+    log("start: PTT = %d, side keys = %d\n", board_check_PTT(), board_check_side_keys());
 
-    // DFU mode -------
-
-    log("start\n");
+    // USB first, so the host can enumerate while the LCD sets up
+    APP_USB_Init();
 
     lcd_init();
     lcd_display_logo();
 
     board_backlight_on(BOARD_DEFAULT_BACKLIGHT_DELAY);
-    APP_USB_Init();
 
     while (1)
     {
@@ -128,29 +120,25 @@ int main()
             }
         }
 
-#if defined(ENABLE_LOGGING)
-        APP_DumpLog();
+        // Sit out a running erase or program in RAM: fetching the main loop
+        // from flash meanwhile would hold up the USB interrupt as well
+        internal_flash_wait();
+
+#if defined(CONFIG_USBDEV_MSC_THREAD)
+        // MSC sector reads and writes, queued by the USB interrupt
+        usb_osal_run();
 #endif
-    }
-}
 
-static BootMode_t GetBootMode()
-{
-    log("PTT = %d, side key1 = %d, M = %d\n", //
-        board_check_PTT(),                    //
-        board_check_side_keys(),              //
-        board_check_M_key()                   //
-    );
+        NVIC_DisableIRQ(USBD_IRQn);
+        usb_fs_process();
+        NVIC_EnableIRQ(USBD_IRQn);
 
-    if (board_check_side_keys())
-    {
-        return BOOT_FW;
-    }
-    if (!board_check_PTT())
-    {
-        return BOOT_FW;
+        lcd_process();
+
+#if defined(ENABLE_LOGGING)
+        APP_DumpLog();
+#endif
     }
-    return BOOT_DFU;
 }
 
 static void APP_SysTick_Init()
@@ -54,6 +54,11 @@ extern "C"
 #include "py32_assert.h"
 #endif /* USE_FULL_ASSERT */
 
+// Places a function in RAM (.ramfunc, copied there by the startup code), so
+// it keeps running while the flash is erasing or programming. Never inlined,
+// which would put its code back into the flash caller.
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline))
+
 uint32_t main_timestamp();
 void main_schedule_reset(uint32_t delay);
 
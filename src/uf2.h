@@ -10,6 +10,56 @@
 #define UF2_FLAG_NOFLASH 0x00000001
 #define UF2_FLAG_FAMILYID_PRESENT 0x00002000
 
+// Payload bytes a block can carry, see uf2_block_t::data
+#define UF2_MAX_PAYLOAD_SIZE 476
+
+// Moto extension: the payload is a uf2_lzss_header_t and an LZSS stream (see
+// lzss.h), which decodes to the data at target_addr. NOFLASH is set as well,
+// so UF2 loaders that do not know the flag skip the block instead of
+// flashing compressed data.
+#define UF2_FLAG_MOTO_LZSS 0x00400000
+// Decoded bytes per block, at most
+#define UF2_LZSS_MAX_SIZE 1024
+
+typedef struct
+{
+    // Whole decoded image, the same in every block
+    uint32_t image_addr;
+    uint32_t image_size;
+} uf2_lzss_header_t;
+
+// Moto extension: the payload is a uf2_verify_t, which the bootloader checks
+// the image against once written. NOFLASH is set as well. The block counts
+// in num_blocks, so the image is only finished once it is in.
+#define UF2_FLAG_MOTO_VERIFY 0x01000000
+
+typedef struct
+{
+    uint32_t image_addr;
+    uint32_t image_size; // Multiple of 4
+    uint32_t image_crc;  // See crc_compute()
+} uf2_verify_t;
+
+// Moto extension: the payload is a uf2_fill_t, and the block sets
+// [target_addr, target_addr + size) to one byte value, standing for the
+// blocks of the image that would have carried it. Its block_no is that of the
+// first of them, and it counts as all of them towards num_blocks, so the
+// blocks after it keep their numbers. NOFLASH is set as well.
+#define UF2_FLAG_MOTO_FILL 0x04000000
+
+typedef struct
+{
+    uint32_t size;   // blocks times the payload size of the others
+    uint32_t blocks; // Block numbers it stands for, from block_no on
+    uint32_t value;  // Byte value, in the low byte
+} uf2_fill_t;
+
+// Moto extension: a command rather than data, the device leaves DFU mode
+// (see utils/uf2conv.py -R). No payload, and NOFLASH is set as well. Refused
+// while an image is being written, and only taken by builds with
+// ENABLE_STAY_IN_DFU.
+#define UF2_FLAG_MOTO_RESET 0x08000000
+
 typedef struct
 {
     // 32 byte header
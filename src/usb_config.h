@@ -44,6 +44,10 @@
 /* Enable test mode */
 // #define CONFIG_USBDEV_TEST_MODE
 
+/* Leave out what the MSC device does not use: MS OS and BOS descriptors, HID
+ * descriptors, vendor requests and alternate settings */
+#define CONFIG_USBDEV_MSC_ONLY
+
 #ifndef CONFIG_USBDEV_MSC_BLOCK_SIZE
 #define CONFIG_USBDEV_MSC_BLOCK_SIZE 512
 #endif
@@ -60,11 +64,16 @@
 #define CONFIG_USBDEV_MSC_VERSION_STRING "1.0"
 #endif
 
-// #define CONFIG_USBDEV_MSC_THREAD
+// CONFIG_USBDEV_MSC_THREAD is set by the Makefile (ENABLE_MSC_THREAD), with
+// usb_osal_baremetal.c running the thread from the main loop
 
 #ifdef CONFIG_USBDEV_MSC_THREAD
 #ifndef CONFIG_USBDEV_MSC_STACKSIZE
-#define CONFIG_USBDEV_MSC_STACKSIZE 2048
+#define CONFIG_USBDEV_MSC_STACKSIZE 1024
+#endif
+
+#ifndef CONFIG_USB_OSAL_STACKSIZE
+#define CONFIG_USB_OSAL_STACKSIZE CONFIG_USBDEV_MSC_STACKSIZE
 #endif
 
 #ifndef CONFIG_USBDEV_MSC_PRIO
@@ -86,7 +95,8 @@
 
 #define USBD_IRQn       USB_IRQn
 
-#define USBD_IRQHandler USB_IRQHandler
+/* Called by USB_IRQHandler() in internal_flash.c once the flash is not busy */
+#define USBD_IRQHandler usbd_irq_handler
 
 void msc_ram_init(void);
 
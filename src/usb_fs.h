@@ -3,10 +3,19 @@
 #define _USB_FS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void usb_fs_configure_done();
 void usb_fs_get_cap(uint32_t *sector_num, uint16_t *sector_size);
 int usb_fs_sector_read(uint32_t sector, uint8_t *buf, uint32_t size);
 int usb_fs_sector_write(uint32_t sector, const uint8_t *buf, uint32_t size);
+// Flushes buffered writes to flash
+int usb_fs_sync();
+// True once after the volume changed under the host, see dfu_medium_changed()
+bool usb_fs_medium_changed();
+// The host ejected the volume, non-zero to refuse
+int usb_fs_eject();
+// Main loop work, must not be interrupted by the USB interrupt
+void usb_fs_process();
 
 #endif
\ No newline at end of file
@@ -81,6 +81,8 @@ const uint8_t msc_flash_descriptor[] = {
     0x00
 };
 
+/* Called in the USB interrupt, so in RAM like it (see usb_config.h). Sector
+ * reads and writes, sync cache and eject run in the MSC thread. */
 void usbd_configure_done_callback(void)
 {
     usb_fs_configure_done();
@@ -101,6 +103,21 @@ int usbd_msc_sector_write(uint32_t sector, uint8_t *buffer, uint32_t length)
     return usb_fs_sector_write(sector, buffer, length);
 }
 
+int usbd_msc_sync_cache(uint8_t lun)
+{
+    return usb_fs_sync();
+}
+
+bool usbd_msc_unit_attention(uint8_t lun)
+{
+    return usb_fs_medium_changed();
+}
+
+int usbd_msc_eject(uint8_t lun)
+{
+    return usb_fs_eject();
+}
+
 struct usbd_interface intf0;
 
 void msc_ram_init(void)
@@ -75,6 +75,48 @@ Reset_Handler:
 /* Call the clock system initialization function.*/
   bl  SystemInit
 
+/* Boot the firmware right away unless DFU mode is asked for, before any of the
+   set-up below (see fw_boot_early). Returns for DFU mode. */
+  bl  fw_boot_early
+
+/* Copy the RAM resident code from flash to SRAM */
+  ldr r0, =_sramfunc
+  ldr r1, =_eramfunc
+  ldr r2, =_siramfunc
+  movs r3, #0
+  b LoopCopyRamfunc
+
+CopyRamfunc:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyRamfunc:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyRamfunc
+
+/* Copy the vector table to SRAM and use it from there, so interrupts do not
+   wait for the flash while it is erasing or programming */
+  ldr r0, =_sram_vector
+  ldr r1, =_eram_vector
+  ldr r2, =g_pfnVectors
+  movs r3, #0
+  b LoopCopyVectors
+
+CopyVectors:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyVectors:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyVectors
+
+  ldr r1, =0xE000ED08   /* SCB->VTOR */
+  str r0, [r1]
+
 /* Copy the data segment initializers from flash to SRAM */
   ldr r0, =_sdata
   ldr r1, =_edata
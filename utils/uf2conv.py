@@ -14,10 +14,28 @@ UF2_MAGIC_START0 = 0x0A324655 # "UF2\n"
 UF2_MAGIC_START1 = 0x9E5D5157 # Randomly selected
 UF2_MAGIC_END    = 0x0AB16F30 # Ditto
 
+UF2_FLAG_NOFLASH = 0x00000001
+# Moto extension: LZSS compressed payload, see src/uf2.h and src/lzss.h
+UF2_FLAG_MOTO_LZSS = 0x00400000
+UF2_LZSS_MAX_SIZE  = 1024
+LZSS_OFFSET_BITS   = 10
+LZSS_LENGTH_BITS   = 4
+LZSS_MIN_MATCH     = 2
+# Moto extension: CRC the bootloader checks the written image against
+UF2_FLAG_MOTO_VERIFY = 0x01000000
+# Moto extension: a run of blocks of one byte value in one block, see src/uf2.h
+UF2_FLAG_MOTO_FILL = 0x04000000
+FILL_MIN_BLOCKS    = 2
+# Moto extension: command block, the device leaves DFU mode, see src/uf2.h
+UF2_FLAG_MOTO_RESET = 0x08000000
+
 INFO_FILE = "/INFO_UF2.TXT"
 
 appstartaddr = 0x2000
 familyid = 0x0
+payloadsize = 256
+compress = False
+fill = False
 
 
 def is_uf2(buf):
@@ -50,11 +68,17 @@ def convert_from_uf2(buf):
         if hd[0] != UF2_MAGIC_START0 or hd[1] != UF2_MAGIC_START1:
             print("Skipping block at " + ptr + "; bad magic")
             continue
-        if hd[2] & 1:
+        data = block[32 : 32 + hd[4]]
+        if hd[2] & UF2_FLAG_MOTO_LZSS:
+            data = lzss_decode(data[8:])
+        elif hd[2] & UF2_FLAG_MOTO_FILL:
+            size, _, value = struct.unpack(b"<III", data[0:12])
+            data = bytes([value & 0xFF]) * size
+        elif hd[2] & 1:
             # NO-flash flag set; skip block
             continue
-        datalen = hd[4]
-        if datalen > 476:
+        datalen = len(data)
+        if hd[4] > 476:
             assert False, "Invalid UF2 data size at " + ptr
         newaddr = hd[3]
         if (hd[2] & 0x2000) and (currfamilyid == None):
@@ -75,7 +99,7 @@ def convert_from_uf2(buf):
             padding -= 4
             outp.append(b"\x00\x00\x00\x00")
         if familyid == 0x0 or ((hd[2] & 0x2000) and familyid == hd[7]):
-            outp.append(block[32 : 32 + datalen])
+            outp.append(data)
         curraddr = newaddr + datalen
         if hd[2] & 0x2000:
             if hd[7] in families_found.keys():
@@ -117,29 +141,192 @@ def convert_to_carray(file_content):
     outp += "\n};\n"
     return bytes(outp, "utf-8")
 
+def fill_run(file_content, blockno, numblocks):
+    # Whole blocks from blockno on that hold nothing but one byte value
+    ptr = payloadsize * blockno
+    value = file_content[ptr]
+    run = 0
+    while blockno + run < numblocks:
+        chunk = file_content[ptr:ptr + payloadsize]
+        if len(chunk) < payloadsize or chunk.count(value) != payloadsize:
+            break
+        run += 1
+        ptr += payloadsize
+    return run, value
+
 def convert_to_uf2(file_content):
     global familyid
     datapadding = b""
-    while len(datapadding) < 512 - 256 - 32 - 4:
+    while len(datapadding) < 512 - payloadsize - 32 - 4:
         datapadding += b"\x00\x00\x00\x00"
-    numblocks = (len(file_content) + 255) // 256
+    numblocks = (len(file_content) + payloadsize - 1) // payloadsize
     outp = []
-    for blockno in range(numblocks):
-        ptr = 256 * blockno
-        chunk = file_content[ptr:ptr + 256]
+    blockno = 0
+    while blockno < numblocks:
+        ptr = payloadsize * blockno
         flags = 0x0
         if familyid:
             flags |= 0x2000
+        run, value = fill_run(file_content, blockno, numblocks) if fill else (0, 0)
+        if run >= FILL_MIN_BLOCKS:
+            # Stands for the blocks of the run, which keep their numbers
+            flags |= UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_FILL
+            payload = struct.pack(b"<III", run * payloadsize, run, value)
+            hd = struct.pack(b"<IIIIIIII",
+                UF2_MAGIC_START0, UF2_MAGIC_START1,
+                flags, ptr + appstartaddr, len(payload), blockno, numblocks, familyid)
+            block = hd + payload + b"\x00" * (476 - len(payload)) + struct.pack(b"<I", UF2_MAGIC_END)
+            assert len(block) == 512
+            outp.append(block)
+            blockno += run
+            continue
+        chunk = file_content[ptr:ptr + payloadsize]
         hd = struct.pack(b"<IIIIIIII",
             UF2_MAGIC_START0, UF2_MAGIC_START1,
-            flags, ptr + appstartaddr, 256, blockno, numblocks, familyid)
-        while len(chunk) < 256:
+            flags, ptr + appstartaddr, payloadsize, blockno, numblocks, familyid)
+        while len(chunk) < payloadsize:
             chunk += b"\x00"
         block = hd + chunk + datapadding + struct.pack(b"<I", UF2_MAGIC_END)
         assert len(block) == 512
         outp.append(block)
+        blockno += 1
+    return b"".join(outp)
+
+def lzss_encode(data):
+    maxlen = LZSS_MIN_MATCH + (1 << LZSS_LENGTH_BITS) - 1
+    window = 1 << LZSS_OFFSET_BITS
+    acc = 0
+    nbits = 0
+    chains = {}
+    i = 0
+    while i < len(data):
+        best_len = 0
+        best_off = 0
+        for p in reversed(chains.get(data[i:i + LZSS_MIN_MATCH], [])):
+            if i - p > window:
+                break
+            m = 0
+            while m < maxlen and i + m < len(data) and data[p + m] == data[i + m]:
+                m += 1
+            if m > best_len:
+                best_len, best_off = m, i - p
+                if m == maxlen:
+                    break
+        if best_len >= LZSS_MIN_MATCH:
+            acc = (acc << (1 + LZSS_OFFSET_BITS + LZSS_LENGTH_BITS)) \
+                | ((best_off - 1) << LZSS_LENGTH_BITS) | (best_len - LZSS_MIN_MATCH)
+            nbits += 1 + LZSS_OFFSET_BITS + LZSS_LENGTH_BITS
+        else:
+            best_len = 1
+            acc = (acc << 9) | 0x100 | data[i]
+            nbits += 9
+        for j in range(i, i + best_len):
+            chains.setdefault(data[j:j + LZSS_MIN_MATCH], []).append(j)
+        i += best_len
+    pad = -nbits % 8
+    return (acc << pad).to_bytes((nbits + pad) // 8, "big")
+
+def lzss_decode(buf):
+    bits = int.from_bytes(buf, "big")
+    pos = len(buf) * 8
+    def get(n):
+        nonlocal pos
+        pos -= n
+        return (bits >> pos) & ((1 << n) - 1)
+    outp = bytearray()
+    while pos >= 9:
+        if get(1):
+            outp.append(get(8))
+            continue
+        if pos < LZSS_OFFSET_BITS + LZSS_LENGTH_BITS:
+            break
+        offset = get(LZSS_OFFSET_BITS) + 1
+        length = get(LZSS_LENGTH_BITS) + LZSS_MIN_MATCH
+        assert offset <= len(outp), "Invalid LZSS stream"
+        for _ in range(length):
+            outp.append(outp[-offset])
+    return bytes(outp)
+
+def convert_to_uf2_lzss(file_content):
+    # Each block takes as much as compresses into it, in whole words but for
+    # the last one
+    room = 476 - 8
+    chunks = []
+    ptr = 0
+    while ptr < len(file_content):
+        remaining = len(file_content) - ptr
+        sizes = list(range(4, min(UF2_LZSS_MAX_SIZE, remaining) + 1, 4))
+        if remaining <= UF2_LZSS_MAX_SIZE and remaining % 4:
+            sizes.append(remaining)
+        lo, hi = 0, len(sizes) - 1
+        while lo < hi:
+            mid = (lo + hi + 1) // 2
+            if len(lzss_encode(file_content[ptr:ptr + sizes[mid]])) <= room:
+                lo = mid
+            else:
+                hi = mid - 1
+        size = sizes[lo]
+        chunks.append((ptr, lzss_encode(file_content[ptr:ptr + size])))
+        ptr += size
+    numblocks = len(chunks)
+    outp = []
+    for blockno, (ptr, stream) in enumerate(chunks):
+        flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_LZSS
+        if familyid:
+            flags |= 0x2000
+        payload = struct.pack(b"<II", appstartaddr, len(file_content)) + stream
+        hd = struct.pack(b"<IIIIIIII",
+            UF2_MAGIC_START0, UF2_MAGIC_START1,
+            flags, ptr + appstartaddr, len(payload), blockno, numblocks, familyid)
+        block = hd + payload + b"\x00" * (476 - len(payload)) + struct.pack(b"<I", UF2_MAGIC_END)
+        assert len(block) == 512
+        outp.append(block)
+    return b"".join(outp)
+
+def crc32_mpeg2(data):
+    # Over little-endian words, as the PY32 CRC unit computes it
+    table = []
+    for i in range(256):
+        c = i << 24
+        for _ in range(8):
+            c = ((c << 1) ^ 0x04C11DB7) if c & 0x80000000 else (c << 1)
+        table.append(c & 0xFFFFFFFF)
+    crc = 0xFFFFFFFF
+    for i in range(0, len(data), 4):
+        for b in reversed(data[i:i + 4]):
+            crc = ((crc << 8) & 0xFFFFFFFF) ^ table[(crc >> 24) ^ b]
+    return crc
+
+def uf2_numblocks(uf2):
+    # Block numbers in use, of which fill blocks take more than one
+    return struct.unpack(b"<I", uf2[24:28])[0]
+
+def append_verify_block(uf2, file_content):
+    # Counts in numblocks, so the device only finishes once it is in
+    numblocks = uf2_numblocks(uf2) + 1
+    outp = []
+    for i in range(len(uf2) // 512):
+        block = uf2[i * 512:(i + 1) * 512]
+        outp.append(block[:24] + struct.pack(b"<I", numblocks) + block[28:])
+    flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_VERIFY
+    if familyid:
+        flags |= 0x2000
+    payload = struct.pack(b"<III", appstartaddr, len(file_content), crc32_mpeg2(file_content))
+    hd = struct.pack(b"<IIIIIIII",
+        UF2_MAGIC_START0, UF2_MAGIC_START1,
+        flags, appstartaddr, len(payload), numblocks - 1, numblocks, familyid)
+    block = hd + payload + b"\x00" * (476 - len(payload)) + struct.pack(b"<I", UF2_MAGIC_END)
+    assert len(block) == 512
+    outp.append(block)
     return b"".join(outp)
 
+def reset_block():
+    flags = UF2_FLAG_NOFLASH | UF2_FLAG_MOTO_RESET
+    hd = struct.pack(b"<IIIIIIII",
+        UF2_MAGIC_START0, UF2_MAGIC_START1,
+        flags, 0, 0, 0, 1, 0)
+    return hd + b"\x00" * 476 + struct.pack(b"<I", UF2_MAGIC_END)
+
 class Block:
     def __init__(self, addr, default_data=0xFF):
         self.addr = addr
@@ -270,7 +457,7 @@ def load_families():
 
 
 def main():
-    global appstartaddr, familyid
+    global appstartaddr, familyid, payloadsize, compress, fill
     def error(msg):
         print(msg, file=sys.stderr)
         sys.exit(1)
@@ -283,6 +470,17 @@ def main():
     parser.add_argument('-f', '--family', dest='family', type=str,
                         default="0x0",
                         help='specify familyID - number or name (default: 0x0)')
+    parser.add_argument('-p', '--payload', dest='payload', type=str,
+                        default="256",
+                        help='data bytes per UF2 block for BIN format, up to 476 (default: 256)')
+    parser.add_argument('-z', '--compress', action='store_true',
+                        help='LZSS compress BIN format blocks (Moto extension)')
+    parser.add_argument('-F', '--fill', action='store_true',
+                        help='put runs of one byte value in BIN format images in fill blocks (Moto extension, builds with ENABLE_UF2_FILL)')
+    parser.add_argument('-v', '--verify', action='store_true',
+                        help='add a CRC block that devices built with ENABLE_UF2_VERIFY check BIN format images against once written (Moto extension)')
+    parser.add_argument('-R', '--reset', action='store_true',
+                        help='make the device leave DFU mode with a RESET.UF2 command block (Moto extension, builds with ENABLE_STAY_IN_DFU), do not convert')
     parser.add_argument('-o', '--output', metavar="FILE", dest='output', type=str,
                         help='write output to named file; defaults to "flash.uf2" or "flash.bin" where sensible')
     parser.add_argument('-d', '--device', dest="device_path",
@@ -301,6 +499,10 @@ def main():
                         help='display header information from UF2, do not convert')
     args = parser.parse_args()
     appstartaddr = int(args.base, 0)
+    payloadsize = int(args.payload, 0)
+    fill = args.fill
+    if payloadsize < 4 or payloadsize > 476 or payloadsize % 4 != 0:
+        error("Payload size needs to be a multiple of 4, up to 476")
 
     families = load_families()
 
@@ -312,7 +514,18 @@ def main():
         except ValueError:
             error("Family ID needs to be a number or one of: " + ", ".join(families.keys()))
 
-    if args.list:
+    if args.reset:
+        outbuf = reset_block()
+        if args.output:
+            write_file(args.output, outbuf)
+        else:
+            drives = get_drives()
+            if len(drives) == 0:
+                error("No drive to reset.")
+            for d in drives:
+                print("Resetting %s (%s)" % (d, board_id(d)))
+                write_file(d + "/RESET.UF2", outbuf)
+    elif args.list:
         list_drives()
     else:
         if not args.input:
@@ -321,6 +534,10 @@ def main():
             inpbuf = f.read()
         from_uf2 = is_uf2(inpbuf)
         ext = "uf2"
+        to_uf2 = not (from_uf2 or args.deploy or args.carray or is_hex(inpbuf))
+        if args.verify and to_uf2:
+            # The device checks whole words
+            inpbuf += b"\x00" * (-len(inpbuf) % 4)
         if args.deploy:
             outbuf = inpbuf
         elif from_uf2 and not args.info:
@@ -334,8 +551,12 @@ def main():
         elif args.carray:
             outbuf = convert_to_carray(inpbuf)
             ext = "h"
+        elif args.compress:
+            outbuf = convert_to_uf2_lzss(inpbuf)
         else:
             outbuf = convert_to_uf2(inpbuf)
+        if args.verify and to_uf2:
+            outbuf = append_verify_block(outbuf, inpbuf)
         if not args.deploy and not args.info:
             print("Converted to %s, output size: %d, start address: 0x%x" %
                   (ext, len(outbuf), appstartaddr))